@@ -0,0 +1,280 @@
+// load generator for a message slot (device file or shared memory)
+// usage: message_bench [-t threads] [-c channels] [-s size | -s min-max]
+//                      [-r read_percent] [-d seconds] <message_slot_file_path>
+// every thread opens the slot, picks a random channel per operation and
+// reads or writes it, then throughput and latency percentiles are reported
+#include "message_slot_shm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <unistd.h>     /* getopt, sleep */
+
+// latency histogram: values below 16ns get their own bucket, larger values
+// are split into 16 buckets per power of two (at most ~6% error)
+#define HIST_SUB_BUCKETS 16
+#define HIST_BUCKETS (61 * HIST_SUB_BUCKETS)
+#define CACHE_LINE 64
+
+typedef struct histogram{
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long total;
+    unsigned long long max;
+} histogram;
+
+typedef struct bench_config{
+    const char* message_slot_file_path;
+    int threads;
+    unsigned int channels;
+    size_t min_size;
+    size_t max_size;
+    int read_percent;
+    int duration;
+} bench_config;
+
+// every thread's state starts on its own cache line, neighbours in the
+// array would otherwise share the lines holding seed and the histograms
+typedef struct bench_thread{
+    pthread_t thread;
+    const bench_config* config;
+    unsigned long long seed;
+    unsigned long long empty_reads;
+    unsigned long long errors;
+    histogram reads;
+    histogram writes;
+} __attribute__((aligned(CACHE_LINE))) bench_thread;
+
+static atomic_int stop;
+// the workers and main meet here once every client is open
+static pthread_barrier_t started;
+
+static int hist_bucket(unsigned long long value) {
+    int shift;
+    if (value < HIST_SUB_BUCKETS){
+        return value;
+    }
+    shift = 63 - __builtin_clzll(value) - 4;
+    return (shift + 1) * HIST_SUB_BUCKETS + ((value >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+static unsigned long long hist_bucket_value(int bucket) {
+    int shift;
+    if (bucket < HIST_SUB_BUCKETS){
+        return bucket;
+    }
+    shift = bucket / HIST_SUB_BUCKETS - 1;
+    return (unsigned long long) (HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS) << shift;
+}
+
+static void hist_add(histogram* hist, unsigned long long value) {
+    hist->counts[hist_bucket(value)]++;
+    hist->total++;
+    if (value > hist->max){
+        hist->max = value;
+    }
+}
+
+static void hist_merge(histogram* into, const histogram* from) {
+    int i;
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->max > into->max){
+        into->max = from->max;
+    }
+}
+
+static unsigned long long hist_percentile(const histogram* hist, double percentile) {
+    unsigned long long rank = (unsigned long long) (hist->total * percentile / 100.0);
+    unsigned long long seen = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        seen += hist->counts[i];
+        if (seen > rank){
+            return hist_bucket_value(i);
+        }
+    }
+    return hist->max;
+}
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, one state per thread */
+static unsigned long long next_random(unsigned long long* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static void* bench_worker(void* arg) {
+    bench_thread* self = (bench_thread*) arg;
+    const bench_config* config = self->config;
+    char the_message[BUF_LEN];
+    msg_slot_client* ifp;
+    unsigned int channel_id, invoked_channel_id = 0;
+    size_t size;
+    unsigned long long start;
+    int is_read;
+    ssize_t returned_val;
+
+    ifp = msg_slot_open(config->message_slot_file_path);
+    if (ifp == NULL){
+        perror("open() failed");
+        exit(1);
+    }
+    memset(the_message, 'x', sizeof(the_message));
+    pthread_barrier_wait(&started);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        channel_id = 1 + next_random(&self->seed) % config->channels;
+        is_read = (int) (next_random(&self->seed) % 100) < config->read_percent;
+        size = config->min_size + next_random(&self->seed) % (config->max_size - config->min_size + 1);
+        start = now_ns();
+        /* the channel switch is part of the operation, as in the real clients */
+        if (channel_id != invoked_channel_id){
+            if (msg_slot_set_channel(ifp, channel_id) < 0){
+                self->errors++;
+                continue;
+            }
+            invoked_channel_id = channel_id;
+        }
+        if (is_read){
+            returned_val = msg_slot_read(ifp, the_message, sizeof(the_message));
+            hist_add(&self->reads, now_ns() - start);
+            if (returned_val < 0){
+                if (errno == EWOULDBLOCK){
+                    self->empty_reads++;
+                } else {
+                    self->errors++;
+                }
+            }
+        } else {
+            returned_val = msg_slot_write(ifp, the_message, size);
+            hist_add(&self->writes, now_ns() - start);
+            if (returned_val < 0){
+                self->errors++;
+            }
+        }
+    }
+    msg_slot_close(ifp);
+    return NULL;
+}
+
+static void print_latency(const char* name, const histogram* hist) {
+    if (hist->total == 0){
+        return;
+    }
+    printf("%-6s %10llu %10llu %10llu %10llu %10llu\n", name,
+           hist_percentile(hist, 50), hist_percentile(hist, 90),
+           hist_percentile(hist, 99), hist_percentile(hist, 99.9), hist->max);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: message_bench [-t threads] [-c channels] [-s size | -s min-max]\n"
+                    "                     [-r read_percent] [-d seconds] <message_slot_file_path>\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    bench_config config = {NULL, 1, 1, BUF_LEN, BUF_LEN, 50, 5};
+    bench_thread* threads;
+    histogram reads, writes;
+    unsigned long long empty_reads = 0, errors = 0, elapsed;
+    msg_slot_client* ifp;
+    char the_message[BUF_LEN];
+    unsigned int channel_id;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "t:c:s:r:d:")) != -1) {
+        switch (opt) {
+            case 't': config.threads = atoi(optarg); break;
+            case 'c': config.channels = atoi(optarg); break;
+            case 's':
+                if (sscanf(optarg, "%zu-%zu", &config.min_size, &config.max_size) != 2){
+                    config.min_size = config.max_size = atol(optarg);
+                }
+                break;
+            case 'r': config.read_percent = atoi(optarg); break;
+            case 'd': config.duration = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if (optind != argc - 1 || config.threads < 1 || config.channels < 1 ||
+        config.min_size < 1 || config.max_size > BUF_LEN || config.min_size > config.max_size ||
+        config.read_percent < 0 || config.read_percent > 100 || config.duration < 1){
+        usage();
+    }
+    config.message_slot_file_path = argv[optind];
+
+    /* publish a message on every channel, so reads don't only measure empty channels */
+    ifp = msg_slot_open(config.message_slot_file_path);
+    if (ifp == NULL){
+        perror("open() failed");
+        exit(1);
+    }
+    memset(the_message, 'x', BUF_LEN);
+    for (channel_id = 1; channel_id <= config.channels; ++channel_id) {
+        if (msg_slot_set_channel(ifp, channel_id) < 0 ||
+            msg_slot_write(ifp, the_message, config.max_size) < 0){
+            perror("populating the channels failed");
+            exit(1);
+        }
+    }
+    msg_slot_close(ifp);
+
+    threads = aligned_alloc(CACHE_LINE, config.threads * sizeof(bench_thread));
+    if (threads == NULL){
+        perror("aligned_alloc() failed");
+        exit(1);
+    }
+    memset(threads, 0, config.threads * sizeof(bench_thread));
+    if (pthread_barrier_init(&started, NULL, config.threads + 1) != 0){
+        perror("pthread_barrier_init() failed");
+        exit(1);
+    }
+    for (i = 0; i < config.threads; ++i) {
+        threads[i].config = &config;
+        threads[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        if (pthread_create(&threads[i].thread, NULL, bench_worker, &threads[i]) != 0){
+            perror("pthread_create() failed");
+            exit(1);
+        }
+    }
+    /* opening the clients isn't part of the run */
+    pthread_barrier_wait(&started);
+    elapsed = now_ns();
+    sleep(config.duration);
+    atomic_store(&stop, 1);
+    memset(&reads, 0, sizeof(reads));
+    memset(&writes, 0, sizeof(writes));
+    for (i = 0; i < config.threads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        hist_merge(&reads, &threads[i].reads);
+        hist_merge(&writes, &threads[i].writes);
+        empty_reads += threads[i].empty_reads;
+        errors += threads[i].errors;
+    }
+    elapsed = now_ns() - elapsed;
+
+    printf("threads %d, channels %u, payload %zu-%zu bytes, reads %d%%, %.2f s\n",
+           config.threads, config.channels, config.min_size, config.max_size,
+           config.read_percent, elapsed / 1e9);
+    printf("%llu ops, %.0f ops/s (%llu reads, %llu empty, %llu writes, %llu errors)\n",
+           reads.total + writes.total, (reads.total + writes.total) / (elapsed / 1e9),
+           reads.total, empty_reads, writes.total, errors);
+    printf("%-6s %10s %10s %10s %10s %10s\n", "ns", "p50", "p90", "p99", "p99.9", "max");
+    print_latency("read", &reads);
+    print_latency("write", &writes);
+    pthread_barrier_destroy(&started);
+    free(threads);
+    exit(0);
+}
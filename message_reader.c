@@ -1,17 +1,205 @@
-#include "message_slot.h"
+// usage: message_reader <message_slot_file_path> <channel_id>
+//        message_reader -f <message_slot_file_path>:<channels>...
+// -f follows the channels, printing their current messages and then every
+// new one as "<channel_id>\t<message>\n" (prefixed by "<path>\t" when more
+// than one slot file is followed). channels is a list of ids and ranges,
+// e.g. "shm:/slot:1,5,10-20", each channel is read through its own client
+// in follow mode and the reader sleeps in msg_slot_poll() between changes.
+// A channel of a device file costs a file descriptor (and an open file in
+// the driver), so the channels of device files must fit in RLIMIT_NOFILE.
+// The channels of a shared memory slot share one mapping of its segment
+// (about 570 KB, one entry of vm.max_map_count) and no descriptor. At most
+// MAX_FOLLOWED channels are followed in all
+#include "message_slot_shm.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 
 #include <fcntl.h>      /* open */
 #include <unistd.h>     /* exit */
 #include <sys/ioctl.h>  /* ioctl */
+#include <sys/resource.h>  /* getrlimit */
+
+#define MAX_FOLLOWED 65536
+// descriptors left for stdio and the shared memory segments
+#define RESERVED_FILES 16
+
+typedef struct followed_channel{
+    const char* message_slot_file_path;
+    unsigned int channel_id;
+    msg_slot_client* ifp;
+} followed_channel;
+
+static followed_channel* followed;
+static int num_followed;
+
+static void follow_channel(const char* message_slot_file_path, unsigned int channel_id) {
+    static int capacity;
+    followed_channel* grown;
+    if (num_followed == MAX_FOLLOWED){
+        fprintf(stderr, "at most %d channels can be followed\n", MAX_FOLLOWED);
+        exit(1);
+    }
+    if (num_followed == capacity){
+        capacity = capacity ? 2 * capacity : 64;
+        grown = realloc(followed, capacity * sizeof(followed_channel));
+        if (grown == NULL){
+            perror("realloc() failed");
+            exit(1);
+        }
+        followed = grown;
+    }
+    followed[num_followed].message_slot_file_path = message_slot_file_path;
+    followed[num_followed].channel_id = channel_id;
+    followed[num_followed].ifp = NULL;
+    num_followed++;
+}
+
+// parses "<path>:<channels>", the path itself may contain ':' ("shm:/slot")
+static void parse_follow_arg(char* arg) {
+    char* channels = strrchr(arg, ':');
+    char* range;
+    unsigned int first, last, channel_id;
+    if (channels == NULL || channels == arg){
+        fprintf(stderr, "expected <message_slot_file_path>:<channels>, got %s\n", arg);
+        exit(1);
+    }
+    *channels++ = '\0';
+    for (range = strtok(channels, ","); range != NULL; range = strtok(NULL, ",")) {
+        if (sscanf(range, "%u-%u", &first, &last) != 2){
+            first = last = strtoul(range, NULL, 10);
+        }
+        if (first == 0 || last < first){
+            fprintf(stderr, "invalid channels %s\n", range);
+            exit(1);
+        }
+        for (channel_id = first; channel_id <= last && channel_id != 0; ++channel_id) {
+            follow_channel(arg, channel_id);
+        }
+    }
+}
+
+// reads the client's message into *buffer, which starts at BUF_LEN bytes
+// and grows while the read fails with ENOSPC, up to MSG_SLOT_STREAM_MAX
+// for a message committed in streaming mode
+static ssize_t read_message(msg_slot_client* ifp, char** buffer, size_t* size) {
+    ssize_t returned_val;
+    char* grown;
+    for (;;) {
+        returned_val = msg_slot_read(ifp, *buffer, *size);
+        if (returned_val >= 0 || errno != ENOSPC || *size >= MSG_SLOT_STREAM_MAX){
+            return returned_val;
+        }
+        grown = realloc(*buffer, *size * 2);
+        if (grown == NULL){
+            perror("realloc() failed");
+            exit(1);
+        }
+        *buffer = grown;
+        *size *= 2;
+    }
+}
+
+static int follow_main(int argc, char** argv) {
+    size_t message_capacity = BUF_LEN;
+    char* the_message = malloc(message_capacity);
+    msg_slot_client** clients;
+    msg_slot_poller* poller;
+    int* ready;
+    int tag_path = 0;
+    int device_channels = 0;
+    struct rlimit files;
+    ssize_t returned_val;
+    int i;
+    if (argc < 3){
+        fprintf(stderr, "usage: message_reader -f <message_slot_file_path>:<channels>...\n");
+        exit(1);
+    }
+    for (i = 2; i < argc; ++i) {
+        parse_follow_arg(argv[i]);
+    }
+    tag_path = argc > 3;
+    /* a device file is opened once per channel */
+    for (i = 0; i < num_followed; ++i) {
+        if (strncmp(followed[i].message_slot_file_path, MSG_SLOT_SHM_PREFIX, strlen(MSG_SLOT_SHM_PREFIX)) != 0){
+            device_channels++;
+        }
+    }
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur != RLIM_INFINITY &&
+        device_channels + RESERVED_FILES > files.rlim_cur){
+        fprintf(stderr, "following %d device file channels takes a descriptor each, "
+                        "the open files limit is %llu (see ulimit -n)\n",
+                device_channels, (unsigned long long) files.rlim_cur);
+        exit(1);
+    }
+    clients = malloc(num_followed * sizeof(msg_slot_client*));
+    ready = malloc(num_followed * sizeof(int));
+    if (clients == NULL || ready == NULL || the_message == NULL){
+        perror("malloc() failed");
+        exit(1);
+    }
+    for (i = 0; i < num_followed; ++i) {
+        followed[i].ifp = msg_slot_open(followed[i].message_slot_file_path);
+        if (followed[i].ifp == NULL){
+            perror("open() failed");
+            exit(1);
+        }
+        if (msg_slot_set_channel(followed[i].ifp, followed[i].channel_id) < 0 ||
+            msg_slot_set_follow(followed[i].ifp, 1) < 0){
+            perror("ioctl() failed");
+            exit(1);
+        }
+        clients[i] = followed[i].ifp;
+    }
+    poller = msg_slot_poller_create(clients, num_followed);
+    if (poller == NULL){
+        perror("malloc() failed");
+        exit(1);
+    }
+    /* stdout is flushed once per wake up, not per message */
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    for (;;) {
+        if (msg_slot_poll(poller, ready, -1) < 0){
+            perror("poll failed");
+            exit(1);
+        }
+        for (i = 0; i < num_followed; ++i) {
+            if (!ready[i]){
+                continue;
+            }
+            returned_val = read_message(clients[i], &the_message, &message_capacity);
+            if (returned_val < 0){
+                /* the message expired since the poll */
+                if (errno == EWOULDBLOCK){
+                    continue;
+                }
+                perror("read() failed");
+                exit(1);
+            }
+            if (tag_path){
+                printf("%s\t", followed[i].message_slot_file_path);
+            }
+            printf("%u\t", followed[i].channel_id);
+            fwrite(the_message, 1, returned_val, stdout);
+            putchar('\n');
+        }
+        if (fflush(stdout) == EOF){
+            perror("Error writing to standard output");
+            exit(1);
+        }
+    }
+}
 
 int main(int argc, char** argv) {
     char the_message[BUF_LEN];
     char* message_slot_file_path;
     unsigned int target_message_channel_id;
-    int ifp; /* file descriptor of message_slot */
+    msg_slot_client* ifp; /* device file or shared memory slot */
     int returned_val;
+    if (argc >= 2 && strcmp(argv[1], "-f") == 0){
+        return follow_main(argc, argv);
+    }
     /* checking if the input is valid */
     if (argc == 3){ /* we include the program's name */
         message_slot_file_path = argv[1];
@@ -20,23 +208,23 @@ int main(int argc, char** argv) {
         perror("Invalid Input!");
         exit(1);
     }
-    ifp = open(message_slot_file_path,O_RDWR);
-    if (ifp < 0){
+    ifp = msg_slot_open(message_slot_file_path);
+    if (ifp == NULL){
         perror("open() failed");
         exit(1);
     }
-    returned_val = ioctl(ifp, MSG_SLOT_CHANNEL, target_message_channel_id);
+    returned_val = msg_slot_set_channel(ifp, target_message_channel_id);
     if (returned_val < 0){
         perror("ioctl() failed");
         exit(1);
     }
     // using the syscall read()
-    returned_val = read(ifp, the_message, BUF_LEN);
+    returned_val = msg_slot_read(ifp, the_message, BUF_LEN);
     if (returned_val < 0){
         perror("read() failed");
         exit(1);
     }
-    close(ifp);
+    msg_slot_close(ifp);
     // to print a message using write() system call,
     // we can write the message to the standard output file descriptor, which is '1'.
     returned_val = write(1, &the_message, returned_val);
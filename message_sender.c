@@ -1,23 +1,244 @@
 // based on "userdev.c" file from recitation 6
-#include "message_slot.h"
+// usage: message_sender <message_slot_file_path> <channel_id> <message>
+//        message_sender -s [-l] [-f file] [-b batch] <message_slot_file_path> <channel_id>...
+// -s streams messages from stdin (or the file given with -f, which is mmapped)
+// over one open slot. Messages are newline delimited, or prefixed with their
+// length as a 4 byte little endian integer with -l, so they may hold any
+// bytes. They go to the given channels in turn, up to "batch" messages
+// (default 256) per write batch
+#include "message_slot_shm.h"
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
 
 #include <fcntl.h>      /* open */
 #include <unistd.h>     /* exit */
 #include <sys/ioctl.h>  /* ioctl */
+#include <sys/mman.h>   /* mmap */
+#include <sys/stat.h>
 
+// stdin is read in chunks of this size, a message never spans more than two
+#define STREAM_CHUNK (1 << 20)
 
+typedef struct stream_state{
+    msg_slot_client* ifp;
+    unsigned int* channels;
+    int num_channels;
+    int next_channel;
+    int length_prefixed;
+    struct msg_slot_batch_entry* batch;
+    unsigned int batch_size;
+    unsigned int batched;
+    unsigned long long sent;
+} stream_state;
+
+static void flush_batch(stream_state* state) {
+    unsigned int done = 0;
+    ssize_t returned_val;
+    while (done < state->batched) {
+        returned_val = msg_slot_write_batch(state->ifp, state->batch + done, state->batched - done);
+        if (returned_val < 0){
+            perror("write failed");
+            exit(1);
+        }
+        done += returned_val;
+    }
+    state->sent += state->batched;
+    state->batched = 0;
+}
+
+static void add_message(stream_state* state, const char* message, size_t length) {
+    struct msg_slot_batch_entry* entry;
+    if (length > BUF_LEN){
+        errno = EMSGSIZE;
+        perror("message too long");
+        exit(1);
+    }
+    entry = &state->batch[state->batched++];
+    entry->channel_id = state->channels[state->next_channel];
+    entry->length = length;
+    entry->buffer = (uintptr_t) message;
+    state->next_channel = (state->next_channel + 1) % state->num_channels;
+    if (state->batched == state->batch_size){
+        flush_batch(state);
+    }
+}
+
+// batches every complete message in data and returns the number of bytes
+// used, at_end also takes a last line without a newline
+static size_t parse_messages(stream_state* state, const char* data, size_t size, int at_end) {
+    size_t pos = 0;
+    const char* line_end;
+    uint32_t length;
+    while (pos < size) {
+        if (state->length_prefixed){
+            if (size - pos < sizeof(length)){
+                break;
+            }
+            length = (unsigned char) data[pos] | (unsigned char) data[pos + 1] << 8 |
+                     (unsigned char) data[pos + 2] << 16 | (uint32_t) (unsigned char) data[pos + 3] << 24;
+            if (length == 0 || length > BUF_LEN){
+                errno = EMSGSIZE;
+                perror("invalid message length");
+                exit(1);
+            }
+            if (size - pos - sizeof(length) < length){
+                break;
+            }
+            add_message(state, data + pos + sizeof(length), length);
+            pos += sizeof(length) + length;
+        } else {
+            line_end = memchr(data + pos, '\n', size - pos);
+            if (line_end == NULL){
+                if (size - pos > BUF_LEN){
+                    add_message(state, data + pos, size - pos);
+                }
+                if (!at_end){
+                    break;
+                }
+                line_end = data + size;
+            }
+            /* empty lines carry no message, the driver refuses empty writes */
+            if (line_end > data + pos){
+                add_message(state, data + pos, line_end - (data + pos));
+            }
+            pos = line_end - data + 1;
+        }
+    }
+    return pos < size ? pos : size;
+}
+
+static void stream_file(stream_state* state, const char* file_path) {
+    struct stat file_stat;
+    void* data;
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &file_stat) < 0){
+        perror("opening the input failed");
+        exit(1);
+    }
+    if (file_stat.st_size == 0){
+        close(fd);
+        return;
+    }
+    data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED){
+        perror("mmap() failed");
+        exit(1);
+    }
+    madvise(data, file_stat.st_size, MADV_SEQUENTIAL);
+    if (parse_messages(state, data, file_stat.st_size, 1) != (size_t) file_stat.st_size){
+        fprintf(stderr, "input ends in the middle of a message\n");
+        exit(1);
+    }
+    flush_batch(state);
+    munmap(data, file_stat.st_size);
+}
+
+static void stream_stdin(stream_state* state) {
+    char* data = malloc(STREAM_CHUNK);
+    size_t size = 0, used;
+    ssize_t returned_val;
+    if (data == NULL){
+        perror("malloc() failed");
+        exit(1);
+    }
+    for (;;) {
+        returned_val = read(STDIN_FILENO, data + size, STREAM_CHUNK - size);
+        if (returned_val < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            perror("reading the input failed");
+            exit(1);
+        }
+        size += returned_val;
+        used = parse_messages(state, data, size, returned_val == 0);
+        /* the batch points into the buffer, send it before moving the rest */
+        flush_batch(state);
+        memmove(data, data + used, size - used);
+        size -= used;
+        if (returned_val == 0){
+            break;
+        }
+    }
+    free(data);
+    if (size != 0){
+        fprintf(stderr, "input ends in the middle of a message\n");
+        exit(1);
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: message_sender <message_slot_file_path> <channel_id> <message>\n"
+                    "       message_sender -s [-l] [-f file] [-b batch] <message_slot_file_path> <channel_id>...\n");
+    exit(1);
+}
+
+static int stream_main(int argc, char** argv) {
+    stream_state state;
+    const char* file_path = NULL;
+    int opt, i;
+
+    memset(&state, 0, sizeof(state));
+    state.batch_size = 256;
+    while ((opt = getopt(argc, argv, "slf:b:")) != -1) {
+        switch (opt) {
+            case 's': break;
+            case 'l': state.length_prefixed = 1; break;
+            case 'f': file_path = optarg; break;
+            case 'b': state.batch_size = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if (argc - optind < 2 || state.batch_size < 1 || state.batch_size > MSG_SLOT_BATCH_MAX){
+        usage();
+    }
+    state.num_channels = argc - optind - 1;
+    state.channels = malloc(state.num_channels * sizeof(unsigned int));
+    state.batch = malloc(state.batch_size * sizeof(struct msg_slot_batch_entry));
+    if (state.channels == NULL || state.batch == NULL){
+        perror("malloc() failed");
+        exit(1);
+    }
+    for (i = 0; i < state.num_channels; ++i) {
+        state.channels[i] = atoi(argv[optind + 1 + i]);
+        if (state.channels[i] == 0){
+            errno = EINVAL;
+            perror("invalid channel id");
+            exit(1);
+        }
+    }
+    state.ifp = msg_slot_open(argv[optind]);
+    if (state.ifp == NULL){
+        perror("open failed");
+        exit(1);
+    }
+    if (file_path != NULL){
+        stream_file(&state, file_path);
+    } else {
+        stream_stdin(&state);
+    }
+    msg_slot_close(state.ifp);
+    fprintf(stderr, "%llu messages sent\n", state.sent);
+    free(state.batch);
+    free(state.channels);
+    exit(0);
+}
 
 int main(int argc, char** argv) {
     char* message_slot_file_path;
     int target_message_channel_id;
     size_t message_size;
     char* message_to_pass;
-    int ifp; /* input_file pointer */
+    msg_slot_client* ifp; /* device file or shared memory slot */
     int returned_val;
+    if (argc >= 2 && argv[1][0] == '-'){
+        return stream_main(argc, argv);
+    }
     /* checking if the input is valid */
     if (argc == 4){ /* we include the program's name */
         message_slot_file_path = argv[1];
@@ -27,22 +248,22 @@ int main(int argc, char** argv) {
         perror("Invalid Input!");
         exit(1);
     }
-    ifp = open(message_slot_file_path,O_RDWR);
-    if (ifp < 0){
+    ifp = msg_slot_open(message_slot_file_path);
+    if (ifp == NULL){
         perror("open failed");
         exit(1);
     }
-    returned_val = ioctl(ifp, MSG_SLOT_CHANNEL, target_message_channel_id);
+    returned_val = msg_slot_set_channel(ifp, target_message_channel_id);
     if (returned_val < 0){
         perror("ioctl failed");
         exit(1);
     }
     message_size = strlen(message_to_pass);
-    returned_val = write(ifp, message_to_pass, message_size);
+    returned_val = msg_slot_write(ifp, message_to_pass, message_size);
     if (returned_val != message_size){
         perror("write failed");
         exit(1);
     }
-    close(ifp);
+    msg_slot_close(ifp);
     exit(0);
 }
@@ -3,17 +3,109 @@
 #define MESSAGE_SLOT_H
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 #define MAJOR_NUM 235
 
 // Set the message of the device driver
 #define MSG_SLOT_CHANNEL _IOW(MAJOR_NUM, 0, unsigned int)
+// Set the time-to-live (in milliseconds) of messages on the invoked channel,
+// 0 means messages never expire
+#define MSG_SLOT_SET_TTL _IOW(MAJOR_NUM, 1, unsigned int)
+// Get the kernel timestamp (CLOCK_REALTIME, in ns) of the message last read
+// from the invoked channel through this file descriptor
+#define MSG_SLOT_GET_TIMESTAMP _IOR(MAJOR_NUM, 2, unsigned long long)
+// Turn streaming mode on (1) or off (0) for this file descriptor.
+// In streaming mode the file offset is the position within the message:
+// read() returns the next chunk of a snapshot taken at offset 0 and 0 at
+// its end, write() stages chunks which are published on MSG_SLOT_COMMIT
+#define MSG_SLOT_SET_STREAM _IOW(MAJOR_NUM, 3, unsigned int)
+// Publish the message staged by streaming writes to the invoked channel
+#define MSG_SLOT_COMMIT _IO(MAJOR_NUM, 4)
+// Place the invoked channel's messages on the given NUMA node,
+// -1 (the default) places each message on the node of its writer
+#define MSG_SLOT_SET_NODE _IOW(MAJOR_NUM, 5, int)
+// Write up to MSG_SLOT_BATCH_MAX messages, each to its own channel, with one
+// call. Returns the number of messages written, they are written in order
+// and the first failure stops the batch (its error is returned if it is the
+// first message). The invoked channel of the file is not changed
+#define MSG_SLOT_WRITE_BATCH _IOW(MAJOR_NUM, 6, struct msg_slot_batch)
+#define MSG_SLOT_BATCH_MAX 1024
+// Follow mode (param 1 enables, 0 disables): a read returns each message
+// written to the invoked channel once, and fails with EWOULDBLOCK until the
+// next write. poll() reports POLLIN while there is a message this file
+// hasn't read, in either mode
+#define MSG_SLOT_SET_FOLLOW _IOW(MAJOR_NUM, 7, unsigned int)
+// replaces the flags of the invoked channel with param (MSG_SLOT_FLAG_*)
+#define MSG_SLOT_SET_FLAGS _IOW(MAJOR_NUM, 8, unsigned int)
+// from now on, the channels created on this minor and the messages of up
+// to BUF_LEN bytes written to them are packed into 2MB physically
+// contiguous chunks. When no chunk is available they are kvmalloc'ed as
+// without the arena. The chunks are kept until the module is unloaded, and
+// MSG_SLOT_SET_NODE doesn't apply to their messages. Whether it beats the
+// slab allocator depends on the machine, measure before enabling it
+#define MSG_SLOT_ENABLE_ARENA _IO(MAJOR_NUM, 9)
+
+// a read-mostly channel: every write also copies the message to each CPU's
+// memory and reads are served from the local copy, so readers on different
+// CPUs don't share a cache line. Writes get slower with the number of CPUs,
+// and messages larger than BUF_LEN (streaming writes) are not replicated
+#define MSG_SLOT_FLAG_PERCPU (1u << 0)
+// a last value wins channel: a write which replaces a message no reader
+// took doesn't wake pollers up again, and when a MSG_SLOT_WRITE_BATCH has
+// several messages for the channel only the last one is published, after
+// the batch's other messages
+#define MSG_SLOT_FLAG_CONFLATE (1u << 1)
+#define MSG_SLOT_FLAGS_ALL (MSG_SLOT_FLAG_PERCPU | MSG_SLOT_FLAG_CONFLATE)
 
 #define DEVICE_RANGE_NAME "message_slot"
 // in write() we write a non-empty message of up to 128 bytes from the user’s buffer to the channel
 #define BUF_LEN 128
+// the largest message which can be written in streaming mode
+#define MSG_SLOT_STREAM_MAX (1 << 20)
 #define DEVICE_FILE_NAME "message_slot_dev"
 #define SUCCESS 0
 #define FAILURE -1
 
+struct msg_slot_batch_entry {
+    __u32 channel_id;
+    __u32 length;
+    // user pointer to the message
+    __u64 buffer;
+};
+
+struct msg_slot_batch {
+    __u32 count;
+    __u32 reserved;
+    // user pointer to count struct msg_slot_batch_entry
+    __u64 entries;
+};
+
+// Snapshot image of all slots, read from and written to
+// <debugfs>/message_slot/snapshot. The image is a header followed by
+// num_records records, each record is followed by its size bytes of message
+#define MSG_SLOT_IMAGE_MAGIC 0x544f4c53 /* "SLOT" */
+#define MSG_SLOT_IMAGE_VERSION 1
+#define MSG_SLOT_SNAPSHOT_DIR "message_slot"
+#define MSG_SLOT_SNAPSHOT_FILE "snapshot"
+
+struct msg_slot_image_header {
+    __u32 magic;
+    __u32 version;
+    __u32 num_records;
+    __u32 reserved;
+};
+
+struct msg_slot_image_record {
+    __u32 minor;
+    __u32 channel_id;
+    __u32 ttl_ms;
+    __s32 home_node;
+    // 0 and no message bytes for an empty channel
+    __u64 timestamp_ns;
+    __u32 size;
+    // MSG_SLOT_FLAG_*, 0 in images of versions without flags
+    __u32 flags;
+};
+
 
 #endif
@@ -0,0 +1,1333 @@
+// this code was factored out of message_slot.c, see message_slot_core.h
+#include "message_slot_core.h"
+
+#ifndef MSG_SLOT_USER_MODE
+#include <linux/uaccess.h>  /* for copy_to_user and put_user */
+#include <linux/string.h>   /* for memset. NOTE - not string.h!*/
+#include <linux/slab.h> /* for GFP_KERNEL flag */
+#include <linux/jiffies.h>  /* for time_after and msecs_to_jiffies */
+#include <linux/timekeeping.h> /* for ktime_get_real_ns */
+#include <linux/topology.h> /* for numa_node_id */
+#include <linux/nodemask.h> /* for node_online */
+#include <linux/percpu.h>   /* for alloc_percpu */
+#include <linux/cpumask.h>  /* for for_each_possible_cpu */
+#include <linux/gfp.h>      /* for alloc_pages_node */
+#include <linux/mm.h>       /* for page_address */
+#endif
+
+int channel_node = NUMA_NO_NODE;
+
+// serialises adding channels and replacing a channel's current_message
+static DEFINE_SPINLOCK(channels_lock);
+
+// each message_slot has a list of channels
+// thus we will make a "global" array which contains
+// a list of channels for each minor num
+
+// we put it here and not in __init so it won't
+// be deleted after module_init()
+channel_list message_slots[MSG_SLOT_MINORS];
+
+//================== MESSAGES AND CHANNELS ======================
+message *message_alloc(size_t capacity, int node)
+{
+    message *msg = kvmalloc_node(struct_size(msg, data, capacity), GFP_KERNEL, node);
+    if (msg == NULL){
+        return NULL;
+    }
+    kref_init(&msg->refcount);
+    msg->arena = NULL;
+    msg->seq = 0;
+    msg->size = 0;
+    msg->capacity = capacity;
+    return msg;
+}
+
+//---------------------------------------------------------------
+// MSG_SLOT_ENABLE_ARENA: with a million channels, kmalloc'ed channels and
+// messages end up all over the slab pages and every lookup and copy can
+// miss the TLB. a minor's arena packs them into 2MB chunks instead, a new
+// channel and its first message usually end up next to each other
+
+// messages are ARENA_BLOCK_SIZE blocks which are reused once freed,
+// channels (reuse == 0) are never freed before the arena is destroyed.
+// blocks are freed from an RCU callback, so the lock is taken with bottom
+// halves disabled everywhere
+static void *arena_alloc(slot_arena *arena, size_t size, int reuse, int node)
+{
+    struct page *page;
+    arena_chunk *chunk;
+    void *block;
+    spin_lock_bh(&arena->lock);
+    for (;;) {
+        block = arena->free_list;
+        if (reuse && block != NULL){
+            arena->free_list = *(void **) block;
+            break;
+        }
+        if (arena->bump_end - arena->bump >= (long) size){
+            block = arena->bump;
+            arena->bump += size;
+            break;
+        }
+        if (arena->chunk_failed &&
+            time_before(jiffies, arena->chunk_failed_at + msecs_to_jiffies(ARENA_RETRY_MS))){
+            spin_unlock_bh(&arena->lock);
+            return NULL;
+        }
+        // we can't allocate pages while holding the lock. a fragmented
+        // machine has no 2MB chunk to spare, so the allocation fails fast
+        // rather than reclaiming and compacting, and the caller falls back
+        spin_unlock_bh(&arena->lock);
+        page = alloc_pages_node(node, GFP_KERNEL | __GFP_COMP | __GFP_NOWARN | __GFP_NORETRY,
+                                get_order(ARENA_CHUNK_SIZE));
+        if (page == NULL){
+            spin_lock_bh(&arena->lock);
+            arena->chunk_failed = 1;
+            arena->chunk_failed_at = jiffies;
+            spin_unlock_bh(&arena->lock);
+            return NULL;
+        }
+        spin_lock_bh(&arena->lock);
+        if ((reuse && arena->free_list != NULL) || arena->bump_end - arena->bump >= (long) size){
+            // another writer added a chunk or freed a block meanwhile
+            spin_unlock_bh(&arena->lock);
+            __free_pages(page, get_order(ARENA_CHUNK_SIZE));
+            spin_lock_bh(&arena->lock);
+            continue;
+        }
+        arena->chunk_failed = 0;
+        chunk = page_address(page);
+        chunk->page = page;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        // the header takes the first block, the little left of an older chunk is dropped
+        arena->bump = (char *) chunk + ARENA_BLOCK_SIZE;
+        arena->bump_end = (char *) chunk + ARENA_CHUNK_SIZE;
+    }
+    spin_unlock_bh(&arena->lock);
+    return block;
+}
+
+// called from message_free_rcu, in softirq context
+static void arena_free(slot_arena *arena, void *block)
+{
+    spin_lock_bh(&arena->lock);
+    *(void **) block = arena->free_list;
+    arena->free_list = block;
+    spin_unlock_bh(&arena->lock);
+}
+
+// all the arena's messages have to be freed already
+static void arena_destroy(slot_arena *arena)
+{
+    arena_chunk *chunk;
+    while (arena->chunks != NULL) {
+        chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        __free_pages(chunk->page, get_order(ARENA_CHUNK_SIZE));
+    }
+    kfree(arena);
+}
+
+int slot_enable_arena(int minor)
+{
+    slot_arena *arena;
+    if (READ_ONCE(message_slots[minor].arena) != NULL){
+        return SUCCESS;
+    }
+    arena = kzalloc(sizeof(slot_arena), GFP_KERNEL);
+    if (arena == NULL){
+        return -ENOMEM;
+    }
+    spin_lock_init(&arena->lock);
+    spin_lock(&channels_lock);
+    if (message_slots[minor].arena == NULL){
+        // writers may pick it up without the lock
+        smp_store_release(&message_slots[minor].arena, arena);
+        arena = NULL;
+    }
+    spin_unlock(&channels_lock);
+    kfree(arena);
+    return SUCCESS;
+}
+
+message *slot_message_alloc(int minor, size_t capacity, int node)
+{
+    slot_arena *arena = smp_load_acquire(&message_slots[minor].arena);
+    message *msg;
+    if (arena == NULL || capacity > BUF_LEN){
+        return message_alloc(capacity, node);
+    }
+    msg = arena_alloc(arena, ARENA_BLOCK_SIZE, 1, node);
+    if (msg == NULL){
+        // the arena is an optimisation, a fragmented machine still works
+        return message_alloc(capacity, node);
+    }
+    kref_init(&msg->refcount);
+    msg->arena = arena;
+    msg->seq = 0;
+    msg->size = 0;
+    msg->capacity = capacity;
+    return msg;
+}
+
+static void message_free_rcu(struct rcu_head *head)
+{
+    message *msg = container_of(head, message, rcu);
+    if (msg->arena != NULL){
+        arena_free(msg->arena, msg);
+    } else {
+        kvfree(msg);
+    }
+}
+
+static void message_release(struct kref *ref)
+{
+    message *msg = container_of(ref, message, refcount);
+    // lockless readers may still be looking at it
+    call_rcu(&msg->rcu, message_free_rcu);
+}
+
+void message_put(message *msg)
+{
+    if (msg != NULL){
+        kref_put(&msg->refcount, message_release);
+    }
+}
+
+//---------------------------------------------------------------
+// MSG_SLOT_FLAG_PERCPU: the replicas are allocated before taking
+// channels_lock, then swapped in together with current_message
+
+// returns an array of per CPU copies of msg indexed by CPU, NULL if msg
+// can't be replicated. a CPU whose copy couldn't be allocated gets NULL
+static message **replicate_message(message *msg)
+{
+    message **copies;
+    int cpu;
+    if (msg == NULL || msg->size > BUF_LEN){
+        return NULL;
+    }
+    copies = kmalloc_array(nr_cpu_ids, sizeof(message *), GFP_KERNEL);
+    if (copies == NULL){
+        return NULL;
+    }
+    for_each_possible_cpu(cpu) {
+        copies[cpu] = message_alloc(msg->size, cpu_to_node(cpu));
+        if (copies[cpu] != NULL){
+            memcpy(copies[cpu]->data, msg->data, msg->size);
+            copies[cpu]->size = msg->size;
+            copies[cpu]->written_at = msg->written_at;
+            copies[cpu]->timestamp_ns = msg->timestamp_ns;
+        }
+    }
+    return copies;
+}
+
+// installs the copies of the message with seq (or clears the replicas if
+// copies is NULL), called with channels_lock held
+static void replicas_install(channel *ch, message **copies, u64 seq)
+{
+    message __rcu **replica;
+    message *old;
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        replica = per_cpu_ptr(ch->replicas, cpu);
+        old = rcu_dereference_protected(*replica, lockdep_is_held(&channels_lock));
+        if (copies != NULL && copies[cpu] != NULL){
+            copies[cpu]->seq = seq;
+            rcu_assign_pointer(*replica, copies[cpu]);
+        } else {
+            RCU_INIT_POINTER(*replica, NULL);
+        }
+        // only queues the free, so it's fine under the lock
+        message_put(old);
+    }
+}
+
+// drops the replicas of a channel nobody can reach anymore, at module unload
+static void replicas_free(channel *ch)
+{
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        message_put(rcu_dereference_protected(*per_cpu_ptr(ch->replicas, cpu), 1));
+    }
+    free_percpu(ch->replicas);
+}
+
+static void copies_free(message **copies)
+{
+    int cpu;
+    if (copies == NULL){
+        return;
+    }
+    for_each_possible_cpu(cpu) {
+        message_put(copies[cpu]);
+    }
+    kfree(copies);
+}
+
+//---------------------------------------------------------------
+// MSG_SLOT_FLAG_CONFLATE: a poller sleeps only after it took the current
+// message (or saw the channel empty), so if nobody took the message a write
+// replaces, everyone waiting was woken up for it already and still has an
+// unread message. taken_seq only grows, a reader holding an older message
+// may get here late
+
+static void channel_mark_taken(channel *ch, u64 seq)
+{
+    u64 taken = READ_ONCE(ch->taken_seq);
+    u64 old;
+    while (taken < seq) {
+        old = cmpxchg64(&ch->taken_seq, taken, seq);
+        if (old == taken){
+            break;
+        }
+        taken = old;
+    }
+}
+
+// called after the message following prev_seq was published, the barrier
+// in wq_has_sleeper orders that before reading taken_seq
+static int channel_should_wake(channel *ch, u64 prev_seq)
+{
+    if (!(READ_ONCE(ch->flags) & MSG_SLOT_FLAG_CONFLATE)){
+        return 1;
+    }
+    return READ_ONCE(ch->taken_seq) >= prev_seq;
+}
+
+// replaces the channel's message with msg (which may be NULL),
+// the channel takes over the caller's reference to msg
+void channel_publish(channel *ch, message *msg)
+{
+    message *old;
+    message **copies = NULL;
+    u64 prev_seq = 0;
+    if (READ_ONCE(ch->flags) & MSG_SLOT_FLAG_PERCPU){
+        copies = replicate_message(msg);
+    }
+    spin_lock(&channels_lock);
+    if (msg != NULL){
+        prev_seq = ch->seq;
+        msg->seq = ++ch->seq;
+    }
+    old = rcu_dereference_protected(ch->current_message,
+                                    lockdep_is_held(&channels_lock));
+    rcu_assign_pointer(ch->current_message, msg);
+    if (msg == NULL && old != NULL){
+        // nobody can take it anymore
+        channel_mark_taken(ch, old->seq);
+    }
+    if (rcu_access_pointer(ch->replicas) != NULL){
+        replicas_install(ch, copies, ch->seq);
+        kfree(copies);
+        copies = NULL;
+    }
+    spin_unlock(&channels_lock);
+    // the flag was cleared while we were copying
+    copies_free(copies);
+    message_put(old);
+    // the barrier in wq_has_sleeper pairs with the one in device_poll, so a
+    // poller either sees the new message or is woken up
+    if (msg != NULL && wq_has_sleeper(&ch->readers) && channel_should_wake(ch, prev_seq)){
+        wake_up_interruptible(&ch->readers);
+    }
+}
+
+// drops the channel's message if it is still msg (or the message msg is
+// a replica of)
+static void channel_expire(channel *ch, message *msg)
+{
+    message *current_message;
+    spin_lock(&channels_lock);
+    current_message = rcu_dereference_protected(ch->current_message,
+                                                lockdep_is_held(&channels_lock));
+    if (current_message != NULL && current_message->seq == msg->seq){
+        RCU_INIT_POINTER(ch->current_message, NULL);
+        channel_mark_taken(ch, msg->seq);
+        if (rcu_access_pointer(ch->replicas) != NULL){
+            replicas_install(ch, NULL, 0);
+        }
+    } else {
+        current_message = NULL;
+    }
+    spin_unlock(&channels_lock);
+    message_put(current_message);
+}
+
+// returns a reference to the channel's current message, or NULL if the
+// channel is empty. a message which outlived its channel's TTL is reported
+// as empty, we reclaim it lazily here instead of running a timer per channel
+message *channel_get_message(channel *ch)
+{
+    message __rcu * __percpu *replicas;
+    message *msg = NULL;
+    rcu_read_lock();
+    // if we migrate after this, we just read another CPU's copy
+    replicas = rcu_dereference(ch->replicas);
+    if (replicas != NULL){
+        msg = rcu_dereference(*raw_cpu_ptr(replicas));
+    }
+    if (msg == NULL){
+        msg = rcu_dereference(ch->current_message);
+    }
+    if (msg != NULL && !kref_get_unless_zero(&msg->refcount)){
+        msg = NULL;
+    }
+    rcu_read_unlock();
+    if (msg != NULL && ch->ttl_ms != 0 &&
+        time_after(jiffies, msg->written_at + msecs_to_jiffies(ch->ttl_ms))){
+        channel_expire(ch, msg);
+        message_put(msg);
+        return NULL;
+    }
+    return msg;
+}
+
+// every write allocates a new message, so unless the channel is pinned
+// to a node its payload follows the writer when the traffic moves
+int channel_node_valid(int node)
+{
+    return node == NUMA_NO_NODE || (node >= 0 && node < MAX_NUMNODES && node_online(node));
+}
+
+int channel_message_node(channel *ch)
+{
+    int node = READ_ONCE(ch->home_node);
+    if (node == NUMA_NO_NODE){
+        return numa_node_id();
+    }
+    return node;
+}
+
+void mark_written(message *msg, size_t length)
+{
+    msg->size = length;
+    msg->written_at = jiffies;
+    msg->timestamp_ns = ktime_get_real_ns();
+}
+
+// returns the channel invoked by the last ioctl on this slot,
+// or NULL if no channel was invoked yet
+channel *find_invoked_channel(message_slot *current_slot)
+{
+    // channels live until the module is unloaded, so the channel found
+    // by the ioctl is still valid and we don't walk the list per read
+    return current_slot->slot_invoked_channel;
+}
+
+// returns the channel channel_id of the given minor, a new empty channel is
+// added at the end of the list if it doesn't exist yet. NULL if kmalloc failed
+channel *find_or_add_channel(int minor, unsigned int channel_id)
+{
+    channel **link = &message_slots[minor].head;
+    channel *temp_head;
+    channel *new_channel = NULL;
+    int new_channel_in_arena;
+    int node;
+    spin_lock(&channels_lock);
+    for (;;) {
+        temp_head = *link;
+        while (temp_head != NULL) {
+            if (temp_head->channel_id == channel_id) {
+                spin_unlock(&channels_lock);
+                // a channel carved from the arena is lost, which is rare enough
+                if (new_channel != NULL && !new_channel->in_arena){
+                    kfree(new_channel);
+                }
+                return temp_head;
+            }
+            link = &temp_head->next;
+            temp_head = *link;
+        }
+        if (new_channel != NULL) {
+            break;
+        }
+        // we can't kmalloc while holding the lock, so we drop it
+        // and search again from where we stopped afterwards
+        spin_unlock(&channels_lock);
+        new_channel = NULL;
+        // the module parameter may change under us
+        node = READ_ONCE(channel_node);
+        if (message_slots[minor].arena != NULL){
+            new_channel = arena_alloc(message_slots[minor].arena,
+                                      ALIGN(sizeof(channel), L1_CACHE_BYTES), 0, node);
+        }
+        new_channel_in_arena = (new_channel != NULL);
+        if (new_channel == NULL){
+            new_channel = kmalloc_node(sizeof(channel), GFP_KERNEL, node);
+        }
+        if (new_channel == NULL) {
+            return NULL;
+        }
+        new_channel->in_arena = new_channel_in_arena;
+        new_channel->channel_id = channel_id;
+        new_channel->next = NULL;
+        RCU_INIT_POINTER(new_channel->current_message, NULL);
+        new_channel->ttl_ms = 0;
+        new_channel->home_node = NUMA_NO_NODE;
+        new_channel->flags = 0;
+        RCU_INIT_POINTER(new_channel->replicas, NULL);
+        new_channel->seq = 0;
+        new_channel->taken_seq = 0;
+        init_waitqueue_head(&new_channel->readers);
+        spin_lock(&channels_lock);
+    }
+    // lockless lookups may walk the list while we append to it
+    smp_store_release(link, new_channel);
+    spin_unlock(&channels_lock);
+    return new_channel;
+}
+
+// called with channels_lock held
+static void channel_flags_changed(channel *ch, unsigned int flags)
+{
+    // reads didn't track taken_seq without MSG_SLOT_FLAG_CONFLATE,
+    // so the next write wakes the pollers up
+    if ((flags & MSG_SLOT_FLAG_CONFLATE) && !(ch->flags & MSG_SLOT_FLAG_CONFLATE)){
+        channel_mark_taken(ch, ch->seq);
+    }
+    WRITE_ONCE(ch->flags, flags);
+}
+
+// MSG_SLOT_SET_FLAGS, may sleep. enabling MSG_SLOT_FLAG_PERCPU replicates
+// the current message right away
+int channel_set_flags(channel *ch, unsigned int flags)
+{
+    message __rcu * __percpu *replicas = NULL;
+    message **copies = NULL;
+    message *msg;
+    if (flags & ~MSG_SLOT_FLAGS_ALL){
+        return -EINVAL;
+    }
+    if (flags & MSG_SLOT_FLAG_PERCPU){
+        replicas = alloc_percpu(message __rcu *);
+        if (replicas == NULL){
+            return -ENOMEM;
+        }
+        msg = channel_get_message(ch);
+        copies = replicate_message(msg);
+        spin_lock(&channels_lock);
+        channel_flags_changed(ch, flags);
+        if (rcu_access_pointer(ch->replicas) == NULL){
+            rcu_assign_pointer(ch->replicas, replicas);
+            replicas = NULL;
+        }
+        // unless a write replaced the message meanwhile
+        if (msg != NULL && rcu_access_pointer(ch->current_message) == msg){
+            replicas_install(ch, copies, msg->seq);
+            kfree(copies);
+            copies = NULL;
+        }
+        spin_unlock(&channels_lock);
+        copies_free(copies);
+        message_put(msg);
+        free_percpu(replicas);
+        return SUCCESS;
+    }
+    spin_lock(&channels_lock);
+    channel_flags_changed(ch, flags);
+    if (rcu_access_pointer(ch->replicas) != NULL){
+        replicas_install(ch, NULL, 0);
+        replicas = rcu_dereference_protected(ch->replicas, lockdep_is_held(&channels_lock));
+        RCU_INIT_POINTER(ch->replicas, NULL);
+    }
+    spin_unlock(&channels_lock);
+    if (replicas != NULL){
+        // readers may still be looking up their CPU's slot
+        synchronize_rcu();
+        free_percpu(replicas);
+    }
+    return SUCCESS;
+}
+
+// publishes whatever a streaming writer has staged so far
+// called with current_slot->lock held
+static void commit_staged_message(message_slot *current_slot)
+{
+    channel *ch = find_invoked_channel(current_slot);
+    message *staged = current_slot->write_staging;
+    current_slot->write_staging = NULL;
+    if (staged == NULL){
+        return;
+    }
+    if (ch == NULL || staged->size == 0){
+        message_put(staged);
+        return;
+    }
+    mark_written(staged, staged->size);
+    channel_publish(ch, staged);
+}
+
+//================== SLOT OPERATIONS ============================
+void slots_init(void)
+{
+    int j;
+//  initiate an empty list for each possible message_slot
+//  with minor number 0<=i<=256
+    for (j = 0; j < MSG_SLOT_MINORS; ++j) {
+        message_slots[j].head = NULL;
+        message_slots[j].arena = NULL;
+    }
+}
+
+void slots_cleanup(void)
+{
+    // free all the allocated memory (list for each message_slot device)
+    channel *temp_head;
+    channel *head;
+    int i;
+    for (i = 0; i < MSG_SLOT_MINORS; ++i) {
+        head = message_slots[i].head;
+        while(head != NULL){
+            temp_head = head;
+            head = head->next;
+            message_put(rcu_dereference_protected(temp_head->current_message, 1));
+            if (temp_head->replicas != NULL){
+                replicas_free(temp_head);
+            }
+            if (!temp_head->in_arena){
+                kfree(temp_head);
+            }
+        }
+        message_slots[i].head = NULL;
+    }
+    // wait for the messages freed above before the module text goes away
+    rcu_barrier();
+    // and before their arenas go away
+    for (i = 0; i < MSG_SLOT_MINORS; ++i) {
+        if (message_slots[i].arena != NULL){
+            arena_destroy(message_slots[i].arena);
+            message_slots[i].arena = NULL;
+        }
+    }
+}
+
+void slot_init(message_slot *slot, int minor)
+{
+    slot->minor_number = minor;
+    slot->slot_invoked_channel_id = 0;
+    slot->slot_invoked_channel = NULL;
+    slot->stream_mode = 0;
+    mutex_init(&slot->lock);
+    slot->read_snapshot = NULL;
+    slot->write_staging = NULL;
+    slot->follow_mode = 0;
+    slot->last_read_seq = 0;
+    slot->last_read_timestamp_ns = 0;
+}
+
+void slot_release(message_slot *slot)
+{
+    // a streaming writer which closes the file publishes what it wrote
+    mutex_lock(&slot->lock);
+    commit_staged_message(slot);
+    message_put(slot->read_snapshot);
+    slot->read_snapshot = NULL;
+    mutex_unlock(&slot->lock);
+    mutex_destroy(&slot->lock);
+}
+
+//---------------------------------------------------------------
+// in follow mode a message already read is not returned again
+message *slot_next_message(message_slot *current_slot, channel *ch)
+{
+    message *msg = channel_get_message(ch);
+    if (msg != NULL && current_slot->follow_mode && msg->seq == current_slot->last_read_seq){
+        message_put(msg);
+        return NULL;
+    }
+    // other channels' readers don't write to the channel
+    if (msg != NULL && (READ_ONCE(ch->flags) & MSG_SLOT_FLAG_CONFLATE)){
+        channel_mark_taken(ch, msg->seq);
+    }
+    return msg;
+}
+
+int slot_has_unread(message_slot *current_slot)
+{
+    channel *ch = find_invoked_channel(current_slot);
+    message *msg;
+    int unread;
+    if (ch == NULL){
+        return 0;
+    }
+    msg = channel_get_message(ch);
+    unread = msg != NULL && msg->seq != current_slot->last_read_seq;
+    message_put(msg);
+    return unread;
+}
+
+//---------------------------------------------------------------
+// streaming read: *offset is the position within a snapshot of the
+// channel's message taken when reading from offset 0, so a large message
+// is read consistently even if it is overwritten between the chunks
+static ssize_t slot_read_stream_locked(message_slot *current_slot,
+                                       channel *ch,
+                                       struct iov_iter* to,
+                                       loff_t* offset)
+{
+    message *snapshot;
+    size_t chunk;
+    if (*offset == 0 || current_slot->read_snapshot == NULL){
+        message_put(current_slot->read_snapshot);
+        current_slot->read_snapshot = slot_next_message(current_slot, ch);
+        *offset = 0;
+    }
+    snapshot = current_slot->read_snapshot;
+    if (snapshot == NULL){
+        return -EWOULDBLOCK;
+    }
+    current_slot->last_read_seq = snapshot->seq;
+    WRITE_ONCE(current_slot->last_read_timestamp_ns, snapshot->timestamp_ns);
+    if (*offset >= snapshot->size){
+        // end of this message, seek back to 0 for the next one
+        return 0;
+    }
+    chunk = min_t(size_t, iov_iter_count(to), snapshot->size - *offset);
+    if (copy_to_iter(snapshot->data + *offset, chunk, to) != chunk){
+        return -EFAULT;
+    }
+    *offset += chunk;
+    return chunk;
+}
+
+// the copy may fault and sleep, so the snapshot is kept under the mutex
+// rather than RCU
+static ssize_t slot_read_stream(message_slot *current_slot, struct iov_iter* to, loff_t* offset)
+{
+    channel *ch;
+    ssize_t rc = -EINVAL;
+    mutex_lock(&current_slot->lock);
+    ch = find_invoked_channel(current_slot);
+    if (ch != NULL){
+        rc = slot_read_stream_locked(current_slot, ch, to, offset);
+    }
+    mutex_unlock(&current_slot->lock);
+    return rc;
+}
+
+//---------------------------------------------------------------
+// a process which has already opened
+// the device file attempts to read from it
+ssize_t slot_read_iter(message_slot *current_slot, struct iov_iter* to, loff_t* offset)
+{
+    channel *temp_head;
+    message *current_message;
+    ssize_t rc;
+    temp_head = find_invoked_channel(current_slot);
+    if (temp_head == NULL){
+        return -EINVAL;
+    }
+    if (READ_ONCE(current_slot->stream_mode)){
+        return slot_read_stream(current_slot, to, offset);
+    }
+    current_message = slot_next_message(current_slot, temp_head);
+    if (current_message == NULL){
+        return -EWOULDBLOCK;
+    }
+    if (iov_iter_count(to) < current_message->size){
+        rc = -ENOSPC;
+    } else if (copy_to_iter(current_message->data, current_message->size, to) != current_message->size){
+        // copy_to_iter returns the number of bytes it could copy
+        rc = -EFAULT;
+    } else {
+        // return the number of input characters used
+        rc = current_message->size;
+        current_slot->last_read_seq = current_message->seq;
+        WRITE_ONCE(current_slot->last_read_timestamp_ns, current_message->timestamp_ns);
+    }
+    message_put(current_message);
+    return rc;
+}
+
+ssize_t slot_read(message_slot *current_slot, char __user* buffer, size_t length, loff_t* offset)
+{
+    struct iovec iov = { .iov_base = buffer, .iov_len = length };
+    struct iov_iter to;
+    if (buffer == NULL){
+        return -EINVAL;
+    }
+    iov_iter_init(&to, READ, &iov, 1, length);
+    return slot_read_iter(current_slot, &to, offset);
+}
+
+
+//---------------------------------------------------------------
+// streaming write: chunks are staged at *offset and published as one
+// message by MSG_SLOT_COMMIT, a channel switch or closing the file
+static ssize_t slot_write_stream_locked(message_slot *current_slot,
+                                        channel *ch,
+                                        struct iov_iter* from,
+                                        loff_t* offset)
+{
+    message *staged = current_slot->write_staging;
+    message *grown;
+    size_t length = iov_iter_count(from);
+    size_t end;
+    if (length == 0 || *offset < 0 || *offset + length > MSG_SLOT_STREAM_MAX){
+        return -EMSGSIZE;
+    }
+    end = *offset + length;
+    if (staged == NULL || end > staged->capacity){
+        // grow geometrically so a stream of small chunks stays linear
+        grown = message_alloc(min_t(size_t, MSG_SLOT_STREAM_MAX,
+                                    max_t(size_t, end, staged ? 2 * staged->capacity : BUF_LEN)),
+                              channel_message_node(ch));
+        if (grown == NULL){
+            return -ENOMEM;
+        }
+        if (staged != NULL){
+            memcpy(grown->data, staged->data, staged->size);
+            grown->size = staged->size;
+            message_put(staged);
+        }
+        staged = grown;
+        current_slot->write_staging = staged;
+    }
+    if (*offset > staged->size){
+        // a hole left by seeking past the end reads as zeroes
+        memset(staged->data + staged->size, 0, *offset - staged->size);
+    }
+    if (copy_from_iter(staged->data + *offset, length, from) != length){
+        return -EFAULT;
+    }
+    if (end > staged->size){
+        staged->size = end;
+    }
+    *offset = end;
+    return length;
+}
+
+static ssize_t slot_write_stream(message_slot *current_slot, struct iov_iter* from, loff_t* offset)
+{
+    channel *ch;
+    ssize_t rc = -EINVAL;
+    mutex_lock(&current_slot->lock);
+    ch = find_invoked_channel(current_slot);
+    if (ch != NULL){
+        rc = slot_write_stream_locked(current_slot, ch, from, offset);
+    }
+    mutex_unlock(&current_slot->lock);
+    return rc;
+}
+
+//---------------------------------------------------------------
+// a processs which has already opened
+// the device file attempts to write to it
+ssize_t slot_write_iter(message_slot *current_slot, struct iov_iter* from, loff_t* offset)
+{
+    channel *temp_head;
+    message *new_message;
+    size_t length = iov_iter_count(from);
+    temp_head = find_invoked_channel(current_slot);
+    if (temp_head == NULL){
+        return -EINVAL;
+    }
+    if (READ_ONCE(current_slot->stream_mode)){
+        return slot_write_stream(current_slot, from, offset);
+    }
+    if (length != 0 && length <= BUF_LEN){
+        new_message = slot_message_alloc(current_slot->minor_number, length, channel_message_node(temp_head));
+        if (new_message == NULL){
+            return -ENOMEM;
+        }
+        // copy into the new message first, so a bad buffer
+        // leaves the channel's current message untouched
+        if (copy_from_iter(new_message->data, length, from) != length){
+            message_put(new_message);
+            return -EFAULT;
+        }
+        mark_written(new_message, length);
+        channel_publish(temp_head, new_message);
+        return length;
+    }else{
+        return -EMSGSIZE;
+    }
+}
+
+ssize_t slot_write(message_slot *current_slot, const char __user* buffer, size_t length, loff_t* offset)
+{
+    struct iovec iov = { .iov_base = (void __user*) buffer, .iov_len = length };
+    struct iov_iter from;
+    if (buffer == NULL){
+        return -EINVAL;
+    }
+    iov_iter_init(&from, WRITE, &iov, 1, length);
+    return slot_write_iter(current_slot, &from, offset);
+}
+
+//----------------------------------------------------------------
+// MSG_SLOT_SET_TTL - applies to the channel invoked on this file
+static long set_channel_ttl(message_slot *chosen_slot, unsigned long ttl_ms)
+{
+    if (chosen_slot->slot_invoked_channel == NULL){
+        return -EINVAL;
+    }
+    chosen_slot->slot_invoked_channel->ttl_ms = ttl_ms;
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------
+// MSG_SLOT_GET_TIMESTAMP - ioctl_param is a user pointer to an unsigned long long,
+// the timestamp is the one of the message this file read last, a write since
+// then doesn't change it
+static long get_channel_timestamp(message_slot *chosen_slot, unsigned long ioctl_param)
+{
+    u64 timestamp_ns;
+    if (chosen_slot->slot_invoked_channel == NULL || ioctl_param == 0){
+        return -EINVAL;
+    }
+    timestamp_ns = READ_ONCE(chosen_slot->last_read_timestamp_ns);
+    if (timestamp_ns == 0){
+        return -EWOULDBLOCK;
+    }
+    if (put_user(timestamp_ns, (u64 __user *) ioctl_param) != 0){
+        return -EFAULT;
+    }
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------
+// MSG_SLOT_SET_NODE - the channel metadata stays where it was created since
+// open files point at it, only the messages written from now on move
+static long set_channel_node(message_slot *chosen_slot, unsigned long ioctl_param)
+{
+    int node = (int) ioctl_param;
+    if (chosen_slot->slot_invoked_channel == NULL){
+        return -EINVAL;
+    }
+    if (!channel_node_valid(node)){
+        return -EINVAL;
+    }
+    WRITE_ONCE(chosen_slot->slot_invoked_channel->home_node, node);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------
+// MSG_SLOT_SET_STREAM - pending chunks are committed before the switch
+static long set_stream_mode(message_slot *chosen_slot, loff_t* f_pos, unsigned long enable)
+{
+    mutex_lock(&chosen_slot->lock);
+    commit_staged_message(chosen_slot);
+    message_put(chosen_slot->read_snapshot);
+    chosen_slot->read_snapshot = NULL;
+    WRITE_ONCE(chosen_slot->stream_mode, (enable != 0));
+    *f_pos = 0;
+    mutex_unlock(&chosen_slot->lock);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------
+// MSG_SLOT_SET_FOLLOW - the current message counts as unread when
+// follow mode is enabled, so a follower starts from the latest value
+static long set_follow_mode(message_slot *chosen_slot, unsigned long enable)
+{
+    chosen_slot->follow_mode = (enable != 0);
+    chosen_slot->last_read_seq = 0;
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------
+// MSG_SLOT_SET_FLAGS
+static long set_channel_flags(message_slot *chosen_slot, unsigned long flags)
+{
+    if (chosen_slot->slot_invoked_channel == NULL){
+        return -EINVAL;
+    }
+    return channel_set_flags(chosen_slot->slot_invoked_channel, flags);
+}
+
+//----------------------------------------------------------------
+// MSG_SLOT_COMMIT
+static long commit_stream(message_slot *chosen_slot, loff_t* f_pos)
+{
+    if (chosen_slot->slot_invoked_channel == NULL){
+        return -EINVAL;
+    }
+    mutex_lock(&chosen_slot->lock);
+    commit_staged_message(chosen_slot);
+    *f_pos = 0;
+    mutex_unlock(&chosen_slot->lock);
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------
+// MSG_SLOT_FLAG_CONFLATE channels of a MSG_SLOT_WRITE_BATCH: each gets a
+// pending message which every write for it replaces, and which is
+// published when the batch ends. nobody sees the replaced message, so its
+// buffer takes the next write instead of a new allocation
+#define CONFLATE_HASH_SIZE (2 * MSG_SLOT_BATCH_MAX)
+
+typedef struct conflated_write{
+    channel *ch;
+    message *pending;
+    // a write is copied here and swapped with pending, so a bad user
+    // buffer leaves the pending message intact
+    message *spare;
+} conflated_write;
+
+typedef struct conflated_batch{
+    unsigned int count;
+    // index + 1 into writes, 0 for a free entry
+    u16 hash[CONFLATE_HASH_SIZE];
+    conflated_write writes[MSG_SLOT_BATCH_MAX];
+} conflated_batch;
+
+static conflated_write *conflated_find(conflated_batch *batch, channel *ch)
+{
+    unsigned int i = ((unsigned long) ch / L1_CACHE_BYTES * 2654435761u) % CONFLATE_HASH_SIZE;
+    conflated_write *write;
+    while (batch->hash[i] != 0) {
+        write = &batch->writes[batch->hash[i] - 1];
+        if (write->ch == ch){
+            return write;
+        }
+        i = (i + 1) % CONFLATE_HASH_SIZE;
+    }
+    write = &batch->writes[batch->count++];
+    batch->hash[i] = batch->count;
+    write->ch = ch;
+    write->pending = NULL;
+    write->spare = NULL;
+    return write;
+}
+
+static int conflate_write(conflated_batch **batch, int minor, channel *ch,
+                          const struct msg_slot_batch_entry *entry)
+{
+    conflated_write *write;
+    message *msg;
+    if (*batch == NULL){
+        *batch = kvmalloc(sizeof(conflated_batch), GFP_KERNEL);
+        if (*batch == NULL){
+            return -ENOMEM;
+        }
+        (*batch)->count = 0;
+        memset((*batch)->hash, 0, sizeof((*batch)->hash));
+    }
+    write = conflated_find(*batch, ch);
+    msg = write->spare;
+    write->spare = NULL;
+    if (msg == NULL || msg->capacity < entry->length){
+        message_put(msg);
+        msg = slot_message_alloc(minor, entry->length, channel_message_node(ch));
+        if (msg == NULL){
+            return -ENOMEM;
+        }
+    }
+    if (copy_from_user(msg->data, (const char __user *) (unsigned long) entry->buffer, entry->length) != 0){
+        write->spare = msg;
+        return -EFAULT;
+    }
+    mark_written(msg, entry->length);
+    write->spare = write->pending;
+    write->pending = msg;
+    return SUCCESS;
+}
+
+static void conflated_publish(conflated_batch *batch)
+{
+    conflated_write *write;
+    unsigned int i;
+    if (batch == NULL){
+        return;
+    }
+    for (i = 0; i < batch->count; ++i) {
+        write = &batch->writes[i];
+        if (write->pending != NULL){
+            channel_publish(write->ch, write->pending);
+        }
+        message_put(write->spare);
+    }
+    kvfree(batch);
+}
+
+//----------------------------------------------------------------
+// MSG_SLOT_WRITE_BATCH - one system call for a batch of plain writes
+static long write_batch(message_slot *chosen_slot, unsigned long ioctl_param)
+{
+    struct msg_slot_batch batch;
+    struct msg_slot_batch_entry entry;
+    const struct msg_slot_batch_entry __user *entries;
+    conflated_batch *conflated = NULL;
+    channel *ch;
+    message *new_message;
+    long written;
+    long rc = SUCCESS;
+    if (copy_from_user(&batch, (const void __user *) ioctl_param, sizeof(batch)) != 0){
+        return -EFAULT;
+    }
+    if (batch.count == 0 || batch.count > MSG_SLOT_BATCH_MAX){
+        return -EINVAL;
+    }
+    entries = (const struct msg_slot_batch_entry __user *) (unsigned long) batch.entries;
+    for (written = 0; written < batch.count; ++written) {
+        if (copy_from_user(&entry, &entries[written], sizeof(entry)) != 0){
+            rc = -EFAULT;
+            break;
+        }
+        if (entry.channel_id == 0){
+            rc = -EINVAL;
+            break;
+        }
+        if (entry.length == 0 || entry.length > BUF_LEN){
+            rc = -EMSGSIZE;
+            break;
+        }
+        ch = find_or_add_channel(chosen_slot->minor_number, entry.channel_id);
+        if (ch == NULL){
+            rc = -ENOMEM;
+            break;
+        }
+        if (READ_ONCE(ch->flags) & MSG_SLOT_FLAG_CONFLATE){
+            rc = conflate_write(&conflated, chosen_slot->minor_number, ch, &entry);
+            if (rc != SUCCESS){
+                break;
+            }
+            continue;
+        }
+        new_message = slot_message_alloc(chosen_slot->minor_number, entry.length, channel_message_node(ch));
+        if (new_message == NULL){
+            rc = -ENOMEM;
+            break;
+        }
+        if (copy_from_user(new_message->data, (const char __user *) (unsigned long) entry.buffer, entry.length) != 0){
+            message_put(new_message);
+            rc = -EFAULT;
+            break;
+        }
+        mark_written(new_message, entry.length);
+        channel_publish(ch, new_message);
+    }
+    conflated_publish(conflated);
+    return written != 0 ? written : rc;
+}
+
+//----------------------------------------------------------------
+long slot_ioctl(message_slot *chosen_slot, loff_t* f_pos, unsigned int ioctl_command_id, unsigned long ioctl_param)
+{
+    // we need to envoke the channel if it hasn't been envoked
+    channel *new_channel;
+    if (ioctl_command_id == MSG_SLOT_SET_TTL){
+        return set_channel_ttl(chosen_slot, ioctl_param);
+    }
+    if (ioctl_command_id == MSG_SLOT_GET_TIMESTAMP){
+        return get_channel_timestamp(chosen_slot, ioctl_param);
+    }
+    if (ioctl_command_id == MSG_SLOT_SET_NODE){
+        return set_channel_node(chosen_slot, ioctl_param);
+    }
+    if (ioctl_command_id == MSG_SLOT_SET_STREAM){
+        return set_stream_mode(chosen_slot, f_pos, ioctl_param);
+    }
+    if (ioctl_command_id == MSG_SLOT_COMMIT){
+        return commit_stream(chosen_slot, f_pos);
+    }
+    if (ioctl_command_id == MSG_SLOT_WRITE_BATCH){
+        return write_batch(chosen_slot, ioctl_param);
+    }
+    if (ioctl_command_id == MSG_SLOT_SET_FOLLOW){
+        return set_follow_mode(chosen_slot, ioctl_param);
+    }
+    if (ioctl_command_id == MSG_SLOT_SET_FLAGS){
+        return set_channel_flags(chosen_slot, ioctl_param);
+    }
+    if (ioctl_command_id == MSG_SLOT_ENABLE_ARENA){
+        return slot_enable_arena(chosen_slot->minor_number);
+    }
+    // Switch according to the ioctl called
+    if (ioctl_command_id != MSG_SLOT_CHANNEL || ioctl_param == 0){
+        return -EINVAL;
+    }
+    // staged chunks belong to the channel they were written for,
+    // and a streaming reader starts over on the new channel
+    mutex_lock(&chosen_slot->lock);
+    commit_staged_message(chosen_slot);
+    message_put(chosen_slot->read_snapshot);
+    chosen_slot->read_snapshot = NULL;
+    chosen_slot->last_read_seq = 0;
+    WRITE_ONCE(chosen_slot->last_read_timestamp_ns, 0);
+    *f_pos = 0;
+
+    new_channel = find_or_add_channel(chosen_slot->minor_number, ioctl_param);
+    if (new_channel == NULL) {
+        mutex_unlock(&chosen_slot->lock);
+        // the error of malloc and calloc on failure as mentioned here:
+        // https://man7.org/linux/man-pages/man3/malloc.3.html
+        return -ENOMEM;
+    }
+    // update the chosen slot that this is the invoked channel
+    chosen_slot->slot_invoked_channel = new_channel;
+    chosen_slot->slot_invoked_channel_id = ioctl_param;
+    mutex_unlock(&chosen_slot->lock);
+    return SUCCESS;
+}
+
+//================== SNAPSHOT ===================================
+int image_reserve(slot_image *img, size_t extra)
+{
+    char *grown;
+    size_t capacity;
+    if (img->size + extra <= img->capacity){
+        return SUCCESS;
+    }
+    capacity = max_t(size_t, img->size + extra, 2 * img->capacity);
+    grown = kvmalloc(capacity, GFP_KERNEL);
+    if (grown == NULL){
+        return -ENOMEM;
+    }
+    if (img->data != NULL){
+        memcpy(grown, img->data, img->size);
+        kvfree(img->data);
+    }
+    img->data = grown;
+    img->capacity = capacity;
+    return SUCCESS;
+}
+
+int export_slots(slot_image *img)
+{
+    struct msg_slot_image_header header = {
+        .magic = MSG_SLOT_IMAGE_MAGIC,
+        .version = MSG_SLOT_IMAGE_VERSION,
+    };
+    struct msg_slot_image_record record;
+    channel *ch;
+    message *msg;
+    int minor;
+    int rc = image_reserve(img, sizeof(header));
+    if (rc != SUCCESS){
+        return rc;
+    }
+    img->size = sizeof(header);
+    for (minor = 0; minor < MSG_SLOT_MINORS; ++minor) {
+        for (ch = message_slots[minor].head; ch != NULL; ch = ch->next) {
+            // empty channels are exported too, to keep their settings
+            msg = channel_get_message(ch);
+            memset(&record, 0, sizeof(record));
+            record.minor = minor;
+            record.channel_id = ch->channel_id;
+            record.ttl_ms = ch->ttl_ms;
+            record.home_node = READ_ONCE(ch->home_node);
+            record.flags = READ_ONCE(ch->flags);
+            if (msg != NULL){
+                record.timestamp_ns = msg->timestamp_ns;
+                record.size = msg->size;
+            }
+            rc = image_reserve(img, sizeof(record) + record.size);
+            if (rc != SUCCESS){
+                message_put(msg);
+                return rc;
+            }
+            memcpy(img->data + img->size, &record, sizeof(record));
+            img->size += sizeof(record);
+            if (msg != NULL){
+                memcpy(img->data + img->size, msg->data, msg->size);
+                img->size += msg->size;
+                message_put(msg);
+            }
+            header.num_records++;
+        }
+    }
+    memcpy(img->data, &header, sizeof(header));
+    return SUCCESS;
+}
+
+static int import_record(const struct msg_slot_image_record *record, const char *data)
+{
+    channel *ch;
+    message *msg;
+    u64 now;
+    u64 age = 0;
+    int rc;
+    if (record->minor >= MSG_SLOT_MINORS || record->channel_id == 0 ||
+        (record->flags & ~MSG_SLOT_FLAGS_ALL)){
+        return -EBADMSG;
+    }
+    ch = find_or_add_channel(record->minor, record->channel_id);
+    if (ch == NULL){
+        return -ENOMEM;
+    }
+    rc = channel_set_flags(ch, record->flags);
+    if (rc != SUCCESS){
+        return rc;
+    }
+    ch->ttl_ms = record->ttl_ms;
+    if (record->home_node >= 0 && record->home_node < MAX_NUMNODES && node_online(record->home_node)){
+        WRITE_ONCE(ch->home_node, record->home_node);
+    } else {
+        WRITE_ONCE(ch->home_node, NUMA_NO_NODE);
+    }
+    if (record->size == 0){
+        channel_publish(ch, NULL);
+        return SUCCESS;
+    }
+    msg = slot_message_alloc(record->minor, record->size, channel_message_node(ch));
+    if (msg == NULL){
+        return -ENOMEM;
+    }
+    memcpy(msg->data, data, record->size);
+    msg->size = record->size;
+    msg->timestamp_ns = record->timestamp_ns;
+    // keep the message's age, so its TTL keeps counting across the reload
+    now = ktime_get_real_ns();
+    if (now > record->timestamp_ns){
+        age = now - record->timestamp_ns;
+    }
+    msg->written_at = jiffies - nsecs_to_jiffies(age);
+    channel_publish(ch, msg);
+    return SUCCESS;
+}
+
+// imports every complete record in img and keeps the incomplete rest
+int import_pending(slot_image *img)
+{
+    struct msg_slot_image_header header;
+    struct msg_slot_image_record record;
+    size_t pos = 0;
+    int rc = SUCCESS;
+    for (;;) {
+        if (!img->header_seen){
+            if (img->size - pos < sizeof(header)){
+                break;
+            }
+            memcpy(&header, img->data + pos, sizeof(header));
+            if (header.magic != MSG_SLOT_IMAGE_MAGIC || header.version != MSG_SLOT_IMAGE_VERSION){
+                return -EBADMSG;
+            }
+            img->header_seen = 1;
+            img->records_left = header.num_records;
+            pos += sizeof(header);
+            continue;
+        }
+        if (img->records_left == 0){
+            // trailing bytes after the last record
+            if (pos < img->size){
+                rc = -EBADMSG;
+            }
+            break;
+        }
+        if (img->size - pos < sizeof(record)){
+            break;
+        }
+        memcpy(&record, img->data + pos, sizeof(record));
+        if (record.size > MSG_SLOT_STREAM_MAX){
+            return -EBADMSG;
+        }
+        if (img->size - pos - sizeof(record) < record.size){
+            break;
+        }
+        rc = import_record(&record, img->data + pos + sizeof(record));
+        if (rc != SUCCESS){
+            break;
+        }
+        pos += sizeof(record) + record.size;
+        img->records_left--;
+    }
+    memmove(img->data, img->data + pos, img->size - pos);
+    img->size -= pos;
+    return rc;
+}
@@ -0,0 +1,197 @@
+// the channel/slot logic of the message_slot driver, independent of the
+// file_operations glue in message_slot_main.c. It is built into the module,
+// and with -DMSG_SLOT_USER_MODE into user-space programs on top of
+// message_slot_shim.h (see message_slot_harness.c)
+#ifndef MESSAGE_SLOT_CORE_H
+#define MESSAGE_SLOT_CORE_H
+
+#include "message_slot.h"
+
+#ifdef MSG_SLOT_USER_MODE
+#include "message_slot_shim.h"
+#else
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/cache.h>
+#include <linux/mm_types.h>
+#include <linux/uio.h>
+#endif
+
+// there are 256 possible minor numbers (0<=minor<=256)
+#define MSG_SLOT_MINORS 257
+
+struct slot_arena;
+
+// a message is never changed after it is published to a channel,
+// a write replaces the channel's pointer with a new message so
+// readers holding a reference keep a consistent snapshot
+typedef struct message{
+    struct kref refcount;
+    struct rcu_head rcu;
+    // the arena the message was carved from, NULL if it was kvmalloc'ed
+    struct slot_arena *arena;
+    // jiffies at the time of the write, used for the TTL check
+    unsigned long written_at;
+    // CLOCK_REALTIME of the write, reported to the user
+    u64 timestamp_ns;
+    // the channel's write counter when it was published, 0 until then
+    u64 seq;
+    size_t size;
+    size_t capacity;
+    char data[];
+} message;
+
+typedef struct channel{
+    unsigned int channel_id;
+    // NULL while the channel is empty
+    message __rcu *current_message;
+    // 0 if messages on this channel never expire
+    unsigned int ttl_ms;
+    // MSG_SLOT_SET_NODE, NUMA_NO_NODE places messages on the writer's node
+    int home_node;
+    // MSG_SLOT_SET_FLAGS
+    unsigned int flags;
+    // MSG_SLOT_FLAG_PERCPU only: each CPU's copy of current_message, NULL
+    // where reads fall back to current_message (see channel_publish)
+    struct message __rcu * __percpu *replicas;
+    // the number of messages published, under channels_lock
+    u64 seq;
+    // MSG_SLOT_FLAG_CONFLATE: the highest seq a reader took, or which
+    // left the channel unread
+    u64 taken_seq;
+    // pollers waiting for the next message
+    wait_queue_head_t readers;
+    // carved from the minor's arena, which frees it
+    int in_arena;
+    struct channel *next;
+} channel;
+
+// MSG_SLOT_ENABLE_ARENA: messages are fixed size blocks of ARENA_BLOCK_SIZE
+// bytes carved out of ARENA_CHUNK_SIZE chunks together with the channels,
+// freed blocks are reused first
+#define ARENA_CHUNK_SIZE (2UL << 20)
+// after a chunk allocation fails the arena falls back to kvmalloc for this
+// long before trying again, instead of compacting memory on every write
+#define ARENA_RETRY_MS 1000
+#define ARENA_BLOCK_SIZE ALIGN(sizeof(message) + BUF_LEN, L1_CACHE_BYTES)
+
+typedef struct arena_chunk{
+    struct page *page;
+    struct arena_chunk *next;
+} arena_chunk;
+
+typedef struct slot_arena{
+    spinlock_t lock;
+    // free blocks, linked through their first word
+    void *free_list;
+    // the unused part of the newest chunk
+    char *bump;
+    char *bump_end;
+    // every chunk starts with its arena_chunk header
+    arena_chunk *chunks;
+    // set with the jiffies a chunk allocation failed at
+    int chunk_failed;
+    unsigned long chunk_failed_at;
+} slot_arena;
+
+typedef struct channel_list{
+    channel *head;
+    // NULL unless MSG_SLOT_ENABLE_ARENA was used on this minor
+    slot_arena *arena;
+} channel_list;
+
+// a data structure to describe individual message slots
+// (device files with different minor numbers)
+typedef struct message_slot{
+    int minor_number;
+    unsigned int slot_invoked_channel_id;
+    channel *slot_invoked_channel;
+    // MSG_SLOT_SET_STREAM state of this file descriptor
+    int stream_mode;
+    // the VFS doesn't serialise calls on a shared char device file, this
+    // guards read_snapshot and write_staging (and the invoked channel
+    // they belong to) between threads using the same file
+    struct mutex lock;
+    // the message a streaming reader is in the middle of
+    message *read_snapshot;
+    // chunks written in streaming mode and not yet committed
+    message *write_staging;
+    // MSG_SLOT_SET_FOLLOW state of this file descriptor
+    int follow_mode;
+    // seq of the last message read from the invoked channel
+    u64 last_read_seq;
+    // timestamp_ns of the last message read from it, 0 before the first
+    // read, for MSG_SLOT_GET_TIMESTAMP
+    u64 last_read_timestamp_ns;
+} message_slot;
+
+// a snapshot image (see message_slot.h), export_slots() builds a whole one,
+// import_pending() consumes every complete record and keeps the rest
+typedef struct slot_image{
+    char *data;
+    size_t size;
+    size_t capacity;
+    // import only: the header was parsed and this many records are left
+    int header_seen;
+    u32 records_left;
+    // import only: the first error, the rest of the image is ignored
+    int error;
+} slot_image;
+
+// the list of channels of every minor number
+extern channel_list message_slots[MSG_SLOT_MINORS];
+// NUMA node for new channels, NUMA_NO_NODE for the invoking process's node
+extern int channel_node;
+
+//================== MESSAGES AND CHANNELS ======================
+message *message_alloc(size_t capacity, int node);
+// message_alloc from the minor's arena, if it has one and capacity fits
+message *slot_message_alloc(int minor, size_t capacity, int node);
+int slot_enable_arena(int minor);
+void message_put(message *msg);
+void mark_written(message *msg, size_t length);
+// returns a reference to the channel's current message, NULL if it is empty
+message *channel_get_message(channel *ch);
+// replaces the channel's message, taking over the caller's reference to msg
+void channel_publish(channel *ch, message *msg);
+int channel_message_node(channel *ch);
+// NUMA_NO_NODE or an online node, for MSG_SLOT_SET_NODE and channel_node
+int channel_node_valid(int node);
+channel *find_invoked_channel(message_slot *current_slot);
+channel *find_or_add_channel(int minor, unsigned int channel_id);
+int channel_set_flags(channel *ch, unsigned int flags);
+
+//================== SLOT OPERATIONS ============================
+// the file operations without the struct file, they return the
+// values the corresponding system calls return
+void slots_init(void);
+void slots_cleanup(void);
+void slot_init(message_slot *slot, int minor);
+void slot_release(message_slot *slot);
+// the iov_iter versions serve read_iter, write_iter and splice, offset
+// is the position streaming mode keeps within the message
+ssize_t slot_read_iter(message_slot *current_slot, struct iov_iter* to, loff_t* offset);
+ssize_t slot_write_iter(message_slot *current_slot, struct iov_iter* from, loff_t* offset);
+ssize_t slot_read(message_slot *current_slot, char __user* buffer, size_t length, loff_t* offset);
+ssize_t slot_write(message_slot *current_slot, const char __user* buffer, size_t length, loff_t* offset);
+// returns a reference to the message a read on ch should return, NULL if
+// there is none (see MSG_SLOT_SET_FOLLOW), a successful read sets
+// last_read_seq to its seq
+message *slot_next_message(message_slot *current_slot, channel *ch);
+// whether the invoked channel has a message this file hasn't read
+int slot_has_unread(message_slot *current_slot);
+// f_pos is the file position, the streaming ioctls reset it
+long slot_ioctl(message_slot *chosen_slot, loff_t* f_pos, unsigned int ioctl_command_id, unsigned long ioctl_param);
+
+//================== SNAPSHOT ===================================
+int image_reserve(slot_image *img, size_t extra);
+int export_slots(slot_image *img);
+int import_pending(slot_image *img);
+
+#endif
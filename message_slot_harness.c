@@ -0,0 +1,642 @@
+// runs message_slot_core.c in user space on top of message_slot_shim.h
+// usage: message_slot_harness check
+//        message_slot_harness bench [channels] [iterations]
+//        message_slot_harness arena [channels] [iterations]
+// "check" exercises the slot operations the way the file operations call
+// them, compares the shared memory backend's (message_slot_shm.h) error
+// codes with the core's, and exits with 1 on the first mismatch. "bench"
+// times channel lookup, channel insertion and the message copy paths,
+// "arena" times reads of random channels with and without
+// MSG_SLOT_ENABLE_ARENA. All of them run under perf, valgrind or a
+// sanitizer build (cmake -DMSG_SLOT_SANITIZE=ON)
+#include "message_slot_core.h"
+#include "message_slot_shm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+unsigned long jiffies;
+
+#define CHECK(cond) do { \
+        if (!(cond)){ \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int list_length(int minor) {
+    channel *ch;
+    int length = 0;
+    for (ch = message_slots[minor].head; ch != NULL; ch = ch->next) {
+        length++;
+    }
+    return length;
+}
+
+//================== CHECKS =====================================
+static void check_basic(void) {
+    message_slot slot, other_slot, other_minor;
+    char buffer[BUF_LEN + 1];
+    loff_t pos = 0;
+    slot_init(&slot, 0);
+    slot_init(&other_slot, 0);
+    slot_init(&other_minor, 1);
+
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == -EINVAL);
+    CHECK(slot_write(&slot, "x", 1, &pos) == -EINVAL);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 0) == -EINVAL);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL + 100, 1) == -EINVAL);
+
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 7) == SUCCESS);
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == -EWOULDBLOCK);
+    CHECK(slot_write(&slot, "hello", 5, &pos) == 5);
+    CHECK(slot_read(&slot, buffer, 4, &pos) == -ENOSPC);
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == 5);
+    CHECK(memcmp(buffer, "hello", 5) == 0);
+    // reads don't consume the message
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == 5);
+    CHECK(slot_write(&slot, buffer, 0, &pos) == -EMSGSIZE);
+    CHECK(slot_write(&slot, buffer, BUF_LEN + 1, &pos) == -EMSGSIZE);
+    memset(buffer, 'b', BUF_LEN);
+    CHECK(slot_write(&slot, buffer, BUF_LEN, &pos) == BUF_LEN);
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == BUF_LEN);
+
+    // the same channel is shared by files of the same minor only
+    CHECK(slot_ioctl(&other_slot, &pos, MSG_SLOT_CHANNEL, 7) == SUCCESS);
+    CHECK(slot_read(&other_slot, buffer, BUF_LEN, &pos) == BUF_LEN);
+    CHECK(slot_ioctl(&other_minor, &pos, MSG_SLOT_CHANNEL, 7) == SUCCESS);
+    CHECK(slot_read(&other_minor, buffer, BUF_LEN, &pos) == -EWOULDBLOCK);
+    CHECK(slot_ioctl(&other_slot, &pos, MSG_SLOT_CHANNEL, 8) == SUCCESS);
+    CHECK(slot_read(&other_slot, buffer, BUF_LEN, &pos) == -EWOULDBLOCK);
+
+    // invoking an existing channel again (also the last one) doesn't add it twice
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 8) == SUCCESS);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 7) == SUCCESS);
+    CHECK(list_length(0) == 2);
+
+    slot_release(&slot);
+    slot_release(&other_slot);
+    slot_release(&other_minor);
+    slots_cleanup();
+}
+
+static void check_ttl(void) {
+    message_slot slot;
+    char buffer[BUF_LEN];
+    unsigned long long timestamp = 0, first_timestamp;
+    loff_t pos = 0;
+    slot_init(&slot, 2);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_SET_TTL, 100) == -EINVAL);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 1) == SUCCESS);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_GET_TIMESTAMP, (unsigned long) &timestamp) == -EWOULDBLOCK);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_SET_TTL, 100) == SUCCESS);
+    CHECK(slot_write(&slot, "fresh", 5, &pos) == 5);
+    // nothing was read through this file yet
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_GET_TIMESTAMP, (unsigned long) &timestamp) == -EWOULDBLOCK);
+    jiffies += 100;
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == 5);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_GET_TIMESTAMP, (unsigned long) &timestamp) == SUCCESS);
+    CHECK(timestamp != 0);
+    first_timestamp = timestamp;
+    jiffies += 1;
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == -EWOULDBLOCK);
+    // still the message this file read, not what the channel holds now
+    CHECK(slot_write(&slot, "again", 5, &pos) == 5);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_GET_TIMESTAMP, (unsigned long) &timestamp) == SUCCESS);
+    CHECK(timestamp == first_timestamp);
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == 5);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_GET_TIMESTAMP, (unsigned long) &timestamp) == SUCCESS);
+    CHECK(timestamp >= first_timestamp);
+    // a channel switch forgets it
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 2) == SUCCESS);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_GET_TIMESTAMP, (unsigned long) &timestamp) == -EWOULDBLOCK);
+    slot_release(&slot);
+    slots_cleanup();
+}
+
+static void check_stream(void) {
+    message_slot writer, reader, other;
+    static char large[3 * 1000], copy[3 * 1000];
+    char buffer[BUF_LEN];
+    loff_t writer_pos = 0, reader_pos = 0, other_pos = 0;
+    size_t read_size = 0;
+    ssize_t returned_val;
+    int i;
+    for (i = 0; i < (int) sizeof(large); ++i) {
+        large[i] = (char) i;
+    }
+    slot_init(&writer, 3);
+    slot_init(&reader, 3);
+    slot_init(&other, 3);
+    CHECK(slot_ioctl(&writer, &writer_pos, MSG_SLOT_CHANNEL, 1) == SUCCESS);
+    CHECK(slot_ioctl(&reader, &reader_pos, MSG_SLOT_CHANNEL, 1) == SUCCESS);
+    CHECK(slot_ioctl(&other, &other_pos, MSG_SLOT_CHANNEL, 1) == SUCCESS);
+    CHECK(slot_ioctl(&writer, &writer_pos, MSG_SLOT_SET_STREAM, 1) == SUCCESS);
+    CHECK(slot_ioctl(&reader, &reader_pos, MSG_SLOT_SET_STREAM, 1) == SUCCESS);
+
+    for (i = 0; i < 3; ++i) {
+        CHECK(slot_write(&writer, large + i * 1000, 1000, &writer_pos) == 1000);
+    }
+    CHECK(writer_pos == sizeof(large));
+    // nothing is visible before the commit
+    CHECK(slot_read(&reader, copy, sizeof(copy), &reader_pos) == -EWOULDBLOCK);
+    CHECK(slot_ioctl(&writer, &writer_pos, MSG_SLOT_COMMIT, 0) == SUCCESS);
+    CHECK(writer_pos == 0);
+
+    // a normal read needs the whole message to fit
+    CHECK(slot_read(&other, buffer, BUF_LEN, &other_pos) == -ENOSPC);
+    CHECK(slot_read(&other, copy, sizeof(copy), &other_pos) == sizeof(large));
+
+    reader_pos = 0;
+    while ((returned_val = slot_read(&reader, copy + read_size, 700, &reader_pos)) > 0) {
+        read_size += returned_val;
+        // an overwrite in the middle doesn't change what the reader sees
+        CHECK(slot_write(&other, "new", 3, &other_pos) == 3);
+    }
+    CHECK(returned_val == 0);
+    CHECK(read_size == sizeof(large));
+    CHECK(memcmp(copy, large, sizeof(large)) == 0);
+    // seeking back to 0 picks up the new message
+    reader_pos = 0;
+    CHECK(slot_read(&reader, copy, sizeof(copy), &reader_pos) == 3);
+
+    // staged chunks are published when the file is closed
+    CHECK(slot_write(&writer, "closing", 7, &writer_pos) == 7);
+    slot_release(&writer);
+    CHECK(slot_read(&other, buffer, BUF_LEN, &other_pos) == 7);
+    CHECK(slot_write(&reader, large, MSG_SLOT_STREAM_MAX + 1, &reader_pos) == -EMSGSIZE);
+
+    slot_release(&reader);
+    slot_release(&other);
+    slots_cleanup();
+}
+
+static void check_snapshot(void) {
+    message_slot slot;
+    slot_image exported = {0}, imported = {0};
+    char buffer[BUF_LEN];
+    loff_t pos = 0;
+    size_t half;
+    slot_init(&slot, 4);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 1) == SUCCESS);
+    CHECK(slot_write(&slot, "one", 3, &pos) == 3);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 2) == SUCCESS);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_SET_TTL, 5000) == SUCCESS);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 3) == SUCCESS);
+    CHECK(slot_write(&slot, "three", 5, &pos) == 5);
+    slot_release(&slot);
+    CHECK(export_slots(&exported) == SUCCESS);
+    slots_cleanup();
+
+    // the import has to cope with records split across writes
+    half = exported.size / 2;
+    CHECK(image_reserve(&imported, exported.size) == SUCCESS);
+    memcpy(imported.data, exported.data, half);
+    imported.size = half;
+    CHECK(import_pending(&imported) == SUCCESS);
+    memcpy(imported.data + imported.size, exported.data + half, exported.size - half);
+    imported.size += exported.size - half;
+    CHECK(import_pending(&imported) == SUCCESS);
+    CHECK(imported.size == 0 && imported.records_left == 0);
+
+    slot_init(&slot, 4);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 1) == SUCCESS);
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == 3 && memcmp(buffer, "one", 3) == 0);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 2) == SUCCESS);
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == -EWOULDBLOCK);
+    CHECK(slot.slot_invoked_channel->ttl_ms == 5000);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 3) == SUCCESS);
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == 5 && memcmp(buffer, "three", 5) == 0);
+    CHECK(list_length(4) == 3);
+
+    // a corrupted image is refused
+    kvfree(imported.data);
+    memset(&imported, 0, sizeof(imported));
+    CHECK(image_reserve(&imported, exported.size) == SUCCESS);
+    memcpy(imported.data, exported.data, exported.size);
+    imported.data[0] ^= 1;
+    imported.size = exported.size;
+    CHECK(import_pending(&imported) == -EBADMSG);
+
+    kvfree(exported.data);
+    kvfree(imported.data);
+    slot_release(&slot);
+    slots_cleanup();
+}
+
+static void check_batch(void) {
+    message_slot slot;
+    struct msg_slot_batch_entry entries[3] = {
+        {1, 3, (unsigned long) "one"},
+        {2, 3, (unsigned long) "two"},
+        {0, 5, (unsigned long) "three"},
+    };
+    struct msg_slot_batch batch = {3, 0, (unsigned long) entries};
+    char buffer[BUF_LEN];
+    loff_t pos = 0;
+    slot_init(&slot, 5);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 9) == SUCCESS);
+    // the batch stops at the invalid channel id
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_WRITE_BATCH, (unsigned long) &batch) == 2);
+    batch.entries = (unsigned long) &entries[2];
+    batch.count = 1;
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_WRITE_BATCH, (unsigned long) &batch) == -EINVAL);
+    batch.count = 0;
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_WRITE_BATCH, (unsigned long) &batch) == -EINVAL);
+    // the invoked channel is left alone
+    CHECK(slot.slot_invoked_channel_id == 9);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 2) == SUCCESS);
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == 3 && memcmp(buffer, "two", 3) == 0);
+    CHECK(list_length(5) == 3);
+    slot_release(&slot);
+    slots_cleanup();
+}
+
+static void check_follow(void) {
+    message_slot follower, writer;
+    char buffer[BUF_LEN];
+    loff_t pos = 0;
+    slot_init(&follower, 6);
+    slot_init(&writer, 6);
+    CHECK(slot_ioctl(&writer, &pos, MSG_SLOT_CHANNEL, 1) == SUCCESS);
+    CHECK(slot_write(&writer, "old", 3, &pos) == 3);
+    CHECK(slot_has_unread(&follower) == 0);
+    CHECK(slot_ioctl(&follower, &pos, MSG_SLOT_CHANNEL, 1) == SUCCESS);
+    CHECK(slot_ioctl(&follower, &pos, MSG_SLOT_SET_FOLLOW, 1) == SUCCESS);
+    // the current message is returned first, and only once
+    CHECK(slot_has_unread(&follower));
+    CHECK(slot_read(&follower, buffer, BUF_LEN, &pos) == 3);
+    CHECK(!slot_has_unread(&follower));
+    CHECK(slot_read(&follower, buffer, BUF_LEN, &pos) == -EWOULDBLOCK);
+    // rewriting the same bytes is still a new message
+    CHECK(slot_write(&writer, "old", 3, &pos) == 3);
+    CHECK(slot_has_unread(&follower));
+    CHECK(slot_read(&follower, buffer, 2, &pos) == -ENOSPC);
+    CHECK(slot_read(&follower, buffer, BUF_LEN, &pos) == 3);
+    CHECK(slot_read(&follower, buffer, BUF_LEN, &pos) == -EWOULDBLOCK);
+    // without follow mode reads repeat, but poll still tracks what was read
+    CHECK(slot_ioctl(&follower, &pos, MSG_SLOT_SET_FOLLOW, 0) == SUCCESS);
+    CHECK(slot_read(&follower, buffer, BUF_LEN, &pos) == 3);
+    CHECK(slot_read(&follower, buffer, BUF_LEN, &pos) == 3);
+    CHECK(!slot_has_unread(&follower));
+    slot_release(&follower);
+    slot_release(&writer);
+    slots_cleanup();
+}
+
+static void check_percpu(void) {
+    message_slot slot;
+    slot_image exported = {0}, imported = {0};
+    static char large[BUF_LEN + 1];
+    char buffer[BUF_LEN];
+    loff_t pos = 0;
+    slot_init(&slot, 7);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_SET_FLAGS, MSG_SLOT_FLAG_PERCPU) == -EINVAL);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 1) == SUCCESS);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_SET_FLAGS, ~0u) == -EINVAL);
+    CHECK(slot_write(&slot, "before", 6, &pos) == 6);
+    // the current message is replicated when the flag is set
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_SET_FLAGS, MSG_SLOT_FLAG_PERCPU) == SUCCESS);
+    CHECK(*slot.slot_invoked_channel->replicas != NULL);
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == 6 && memcmp(buffer, "before", 6) == 0);
+    CHECK(slot_write(&slot, "after", 5, &pos) == 5);
+    CHECK((*slot.slot_invoked_channel->replicas)->seq == slot.slot_invoked_channel->seq);
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == 5 && memcmp(buffer, "after", 5) == 0);
+
+    // a large message is read from the channel itself
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_SET_STREAM, 1) == SUCCESS);
+    CHECK(slot_write(&slot, large, sizeof(large), &pos) == sizeof(large));
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_COMMIT, 0) == SUCCESS);
+    CHECK(*slot.slot_invoked_channel->replicas == NULL);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_SET_STREAM, 0) == SUCCESS);
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == -ENOSPC);
+
+    // an expired replica expires the channel's message
+    CHECK(slot_write(&slot, "ttl", 3, &pos) == 3);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_SET_TTL, 10) == SUCCESS);
+    jiffies += 11;
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == -EWOULDBLOCK);
+    CHECK(slot.slot_invoked_channel->current_message == NULL);
+    CHECK(*slot.slot_invoked_channel->replicas == NULL);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_SET_TTL, 0) == SUCCESS);
+
+    // the flag survives a snapshot
+    CHECK(slot_write(&slot, "kept", 4, &pos) == 4);
+    slot_release(&slot);
+    CHECK(export_slots(&exported) == SUCCESS);
+    slots_cleanup();
+    CHECK(image_reserve(&imported, exported.size) == SUCCESS);
+    memcpy(imported.data, exported.data, exported.size);
+    imported.size = exported.size;
+    CHECK(import_pending(&imported) == SUCCESS);
+    slot_init(&slot, 7);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 1) == SUCCESS);
+    CHECK(slot.slot_invoked_channel->flags == MSG_SLOT_FLAG_PERCPU);
+    CHECK(*slot.slot_invoked_channel->replicas != NULL);
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == 4 && memcmp(buffer, "kept", 4) == 0);
+
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_SET_FLAGS, 0) == SUCCESS);
+    CHECK(slot.slot_invoked_channel->replicas == NULL);
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == 4);
+    kvfree(exported.data);
+    kvfree(imported.data);
+    slot_release(&slot);
+    slots_cleanup();
+}
+
+static void check_arena(void) {
+    message_slot slot;
+    static char large[BUF_LEN + 1];
+    char buffer[BUF_LEN];
+    slot_arena *arena;
+    loff_t pos = 0;
+    int i;
+    slot_init(&slot, 8);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 1) == SUCCESS);
+    CHECK(slot_write(&slot, "kvmalloc", 8, &pos) == 8);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_ENABLE_ARENA, 0) == SUCCESS);
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_ENABLE_ARENA, 0) == SUCCESS);
+    arena = message_slots[8].arena;
+    CHECK(arena != NULL && arena->chunks == NULL);
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == 8);
+    // overwrites reuse the freed blocks
+    for (i = 1; i <= 100000; ++i) {
+        CHECK(slot_write(&slot, (const char *) &i, sizeof(i), &pos) == sizeof(i));
+    }
+    CHECK(slot.slot_invoked_channel->current_message->arena == arena);
+    CHECK(arena->chunks != NULL && arena->chunks->next == NULL);
+    --i;
+    CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == sizeof(i) && memcmp(buffer, &i, sizeof(i)) == 0);
+    // a streamed message doesn't fit in a block
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_SET_STREAM, 1) == SUCCESS);
+    CHECK(slot_write(&slot, large, sizeof(large), &pos) == sizeof(large));
+    CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_COMMIT, 0) == SUCCESS);
+    CHECK(slot.slot_invoked_channel->current_message->arena == NULL);
+    // other minors are not affected
+    CHECK(message_slots[9].arena == NULL);
+    slot_release(&slot);
+    slots_cleanup();
+    CHECK(message_slots[8].arena == NULL);
+}
+
+static void check_conflate(void) {
+    message_slot writer, reader;
+    struct msg_slot_batch_entry entries[5] = {
+        {1, 3, (unsigned long) "one"},
+        {2, 3, (unsigned long) "two"},
+        {1, 5, (unsigned long) "uno!!"},
+        {2, 3, 0},
+        {1, 4, (unsigned long) "eins"},
+    };
+    struct msg_slot_batch batch = {5, 0, (unsigned long) entries};
+    char buffer[BUF_LEN];
+    loff_t pos = 0;
+    channel *ch;
+    message *published;
+    slot_init(&writer, 10);
+    slot_init(&reader, 10);
+    CHECK(slot_ioctl(&writer, &pos, MSG_SLOT_CHANNEL, 1) == SUCCESS);
+    CHECK(slot_ioctl(&writer, &pos, MSG_SLOT_SET_FLAGS, MSG_SLOT_FLAG_CONFLATE) == SUCCESS);
+    ch = writer.slot_invoked_channel;
+    CHECK(slot_ioctl(&reader, &pos, MSG_SLOT_CHANNEL, 1) == SUCCESS);
+
+    // only a write replacing a taken message wakes the pollers up
+    CHECK(slot_write(&writer, "a", 1, &pos) == 1);
+    CHECK(ch->readers.wakeups == 1);
+    CHECK(slot_write(&writer, "b", 1, &pos) == 1);
+    CHECK(slot_write(&writer, "c", 1, &pos) == 1);
+    CHECK(ch->readers.wakeups == 1);
+    CHECK(slot_read(&reader, buffer, BUF_LEN, &pos) == 1 && buffer[0] == 'c');
+    CHECK(slot_write(&writer, "d", 1, &pos) == 1);
+    CHECK(ch->readers.wakeups == 2);
+    // an expired message counts as taken
+    CHECK(slot_ioctl(&writer, &pos, MSG_SLOT_SET_TTL, 10) == SUCCESS);
+    jiffies += 11;
+    CHECK(slot_read(&reader, buffer, BUF_LEN, &pos) == -EWOULDBLOCK);
+    CHECK(slot_ioctl(&writer, &pos, MSG_SLOT_SET_TTL, 0) == SUCCESS);
+    CHECK(slot_write(&writer, "e", 1, &pos) == 1);
+    CHECK(ch->readers.wakeups == 3);
+
+    // a batch publishes the last message of the channel once
+    CHECK(slot_read(&reader, buffer, BUF_LEN, &pos) == 1);
+    CHECK(slot_ioctl(&writer, &pos, MSG_SLOT_CHANNEL, 2) == SUCCESS);
+    CHECK(slot_ioctl(&writer, &pos, MSG_SLOT_SET_FLAGS, MSG_SLOT_FLAG_CONFLATE) == SUCCESS);
+    batch.count = 3;
+    CHECK(slot_ioctl(&writer, &pos, MSG_SLOT_WRITE_BATCH, (unsigned long) &batch) == 3);
+    CHECK(ch->readers.wakeups == 4);
+    published = ch->current_message;
+    CHECK(slot_read(&reader, buffer, BUF_LEN, &pos) == 5 && memcmp(buffer, "uno!!", 5) == 0);
+    // a failed write ends the batch, channel 1's last message before it is
+    // still published, channel 2's messages are published as they come
+    CHECK(slot_ioctl(&writer, &pos, MSG_SLOT_SET_FLAGS, 0) == SUCCESS);
+    batch.count = 5;
+    CHECK(slot_write(&writer, "x", 1, &pos) == 1);
+    CHECK(slot_ioctl(&writer, &pos, MSG_SLOT_WRITE_BATCH, (unsigned long) &batch) == 3);
+    CHECK(ch->current_message != published);
+    CHECK(slot_read(&reader, buffer, BUF_LEN, &pos) == 5 && memcmp(buffer, "uno!!", 5) == 0);
+    CHECK(slot_ioctl(&reader, &pos, MSG_SLOT_CHANNEL, 2) == SUCCESS);
+    CHECK(slot_read(&reader, buffer, BUF_LEN, &pos) == 3 && memcmp(buffer, "two", 3) == 0);
+    slot_release(&writer);
+    slot_release(&reader);
+    slots_cleanup();
+}
+
+// runs an operation on a slot of the core, which returns -errno, and the
+// same one on a shared memory client, which returns -1 and sets errno
+#define CHECK_SAME(core_call, shm_call) do { \
+        long core_rc = (core_call); \
+        long shm_rc = (shm_call); \
+        CHECK(core_rc == (shm_rc < 0 ? -errno : shm_rc)); \
+    } while (0)
+
+static void check_shm(void) {
+    message_slot slot;
+    msg_slot_client* client;
+    struct msg_slot_batch_entry entries[2] = {
+        {1, 3, (unsigned long) "one"},
+        {0, 3, (unsigned long) "two"},
+    };
+    struct msg_slot_batch batch = {1, 0, (unsigned long) entries};
+    char buffer[BUF_LEN + 1];
+    char path[64];
+    loff_t pos = 0;
+    snprintf(path, sizeof(path), "%s/message_slot_harness.%d", MSG_SLOT_SHM_PREFIX, (int) getpid());
+    client = msg_slot_open(path);
+    CHECK(client != NULL);
+    slot_init(&slot, 11);
+    memset(buffer, 'x', sizeof(buffer));
+
+    // no channel invoked yet
+    CHECK_SAME(slot_read(&slot, buffer, BUF_LEN, &pos), msg_slot_read(client, buffer, BUF_LEN));
+    CHECK_SAME(slot_write(&slot, "x", 1, &pos), msg_slot_write(client, "x", 1));
+    CHECK_SAME(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 0), msg_slot_set_channel(client, 0));
+    CHECK_SAME(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, 4), msg_slot_set_channel(client, 4));
+    CHECK_SAME(slot_read(&slot, buffer, BUF_LEN, &pos), msg_slot_read(client, buffer, BUF_LEN));
+    CHECK_SAME(slot_read(&slot, NULL, BUF_LEN, &pos), msg_slot_read(client, NULL, BUF_LEN));
+    CHECK_SAME(slot_write(&slot, NULL, 1, &pos), msg_slot_write(client, NULL, 1));
+    CHECK_SAME(slot_write(&slot, buffer, 0, &pos), msg_slot_write(client, buffer, 0));
+    CHECK_SAME(slot_write(&slot, buffer, BUF_LEN + 1, &pos), msg_slot_write(client, buffer, BUF_LEN + 1));
+    CHECK_SAME(slot_write(&slot, "hello", 5, &pos), msg_slot_write(client, "hello", 5));
+    CHECK_SAME(slot_read(&slot, buffer, 4, &pos), msg_slot_read(client, buffer, 4));
+    CHECK_SAME(slot_read(&slot, buffer, BUF_LEN, &pos), msg_slot_read(client, buffer, BUF_LEN));
+    // follow mode returns the current message once
+    CHECK_SAME(slot_ioctl(&slot, &pos, MSG_SLOT_SET_FOLLOW, 1), msg_slot_set_follow(client, 1));
+    CHECK_SAME(slot_read(&slot, buffer, BUF_LEN, &pos), msg_slot_read(client, buffer, BUF_LEN));
+    CHECK_SAME(slot_read(&slot, buffer, BUF_LEN, &pos), msg_slot_read(client, buffer, BUF_LEN));
+    CHECK_SAME(slot_ioctl(&slot, &pos, MSG_SLOT_SET_FOLLOW, 0), msg_slot_set_follow(client, 0));
+    // batches
+    CHECK_SAME(slot_ioctl(&slot, &pos, MSG_SLOT_WRITE_BATCH, (unsigned long) &batch),
+               msg_slot_write_batch(client, entries, 1));
+    batch.entries = (unsigned long) &entries[1];
+    CHECK_SAME(slot_ioctl(&slot, &pos, MSG_SLOT_WRITE_BATCH, (unsigned long) &batch),
+               msg_slot_write_batch(client, &entries[1], 1));
+    batch.count = 0;
+    CHECK_SAME(slot_ioctl(&slot, &pos, MSG_SLOT_WRITE_BATCH, (unsigned long) &batch),
+               msg_slot_write_batch(client, entries, 0));
+    batch.count = MSG_SLOT_BATCH_MAX + 1;
+    CHECK_SAME(slot_ioctl(&slot, &pos, MSG_SLOT_WRITE_BATCH, (unsigned long) &batch),
+               msg_slot_write_batch(client, entries, MSG_SLOT_BATCH_MAX + 1));
+    entries[1].channel_id = 2;
+    entries[1].length = 0;
+    batch.count = 1;
+    CHECK_SAME(slot_ioctl(&slot, &pos, MSG_SLOT_WRITE_BATCH, (unsigned long) &batch),
+               msg_slot_write_batch(client, &entries[1], 1));
+
+    msg_slot_close(client);
+    shm_unlink(path + strlen(MSG_SLOT_SHM_PREFIX));
+    slot_release(&slot);
+    slots_cleanup();
+}
+
+//================== BENCHMARKS =================================
+static void bench(unsigned int channels, long iterations) {
+    message_slot slot;
+    char buffer[BUF_LEN];
+    unsigned int *ids = malloc(iterations * sizeof(unsigned int));
+    unsigned int i;
+    loff_t pos = 0;
+    double start;
+    long j;
+    if (ids == NULL){
+        perror("malloc() failed");
+        exit(1);
+    }
+    for (j = 0; j < iterations; ++j) {
+        ids[j] = 1 + (unsigned int) (((unsigned long long) j * 2654435761u) % channels);
+    }
+    slot_init(&slot, 0);
+
+    start = now_ns();
+    for (i = 1; i <= channels; ++i) {
+        CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, i) == SUCCESS);
+    }
+    printf("insert\t%u channels\t%.1f ns/op\n", channels, (now_ns() - start) / channels);
+
+    start = now_ns();
+    for (j = 0; j < iterations; ++j) {
+        CHECK(slot_ioctl(&slot, &pos, MSG_SLOT_CHANNEL, ids[j]) == SUCCESS);
+    }
+    printf("lookup\t%u channels\t%.1f ns/op\n", channels, (now_ns() - start) / iterations);
+
+    memset(buffer, 'x', BUF_LEN);
+    start = now_ns();
+    for (j = 0; j < iterations; ++j) {
+        CHECK(slot_write(&slot, buffer, BUF_LEN, &pos) == BUF_LEN);
+    }
+    printf("write\t%d bytes\t%.1f ns/op\n", BUF_LEN, (now_ns() - start) / iterations);
+
+    start = now_ns();
+    for (j = 0; j < iterations; ++j) {
+        CHECK(slot_read(&slot, buffer, BUF_LEN, &pos) == BUF_LEN);
+    }
+    printf("read\t%d bytes\t%.1f ns/op\n", BUF_LEN, (now_ns() - start) / iterations);
+
+    slot_release(&slot);
+    slots_cleanup();
+    free(ids);
+}
+
+// reads of random channels, each holding a BUF_LEN message, the channels
+// are used directly so the list walk of the channel lookup isn't timed
+static void bench_arena(unsigned int channels, long iterations) {
+    char buffer[BUF_LEN];
+    channel **chs = malloc(channels * sizeof(channel *));
+    unsigned int *ids = malloc(iterations * sizeof(unsigned int));
+    unsigned long long state = 0x9E3779B97F4A7C15ULL;
+    message *msg;
+    unsigned int i;
+    int use_arena;
+    double start;
+    long j;
+    if (chs == NULL || ids == NULL){
+        perror("malloc() failed");
+        exit(1);
+    }
+    for (j = 0; j < iterations; ++j) {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        ids[j] = (state * 2685821657736338717ULL) % channels;
+    }
+    memset(buffer, 'x', BUF_LEN);
+    for (use_arena = 0; use_arena < 2; ++use_arena) {
+        if (use_arena){
+            CHECK(slot_enable_arena(0) == SUCCESS);
+        }
+        for (i = 0; i < channels; ++i) {
+            chs[i] = find_or_add_channel(0, i + 1);
+            msg = slot_message_alloc(0, BUF_LEN, 0);
+            CHECK(chs[i] != NULL && msg != NULL);
+            memcpy(msg->data, buffer, BUF_LEN);
+            mark_written(msg, BUF_LEN);
+            channel_publish(chs[i], msg);
+        }
+        start = now_ns();
+        for (j = 0; j < iterations; ++j) {
+            msg = channel_get_message(chs[ids[j]]);
+            memcpy(buffer, msg->data, msg->size);
+            message_put(msg);
+        }
+        printf("read\t%s\t%u channels\t%.1f ns/op\n", use_arena ? "arena" : "kvmalloc",
+               channels, (now_ns() - start) / iterations);
+        slots_cleanup();
+    }
+    free(ids);
+    free(chs);
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 2 && strcmp(argv[1], "check") == 0){
+        check_basic();
+        check_ttl();
+        check_stream();
+        check_snapshot();
+        check_batch();
+        check_follow();
+        check_percpu();
+        check_arena();
+        check_conflate();
+        check_shm();
+        printf("all checks passed\n");
+        exit(0);
+    }
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0){
+        bench(argc >= 3 ? (unsigned int) atoi(argv[2]) : 1000,
+              argc >= 4 ? atol(argv[3]) : 1000000);
+        exit(0);
+    }
+    if (argc >= 2 && strcmp(argv[1], "arena") == 0){
+        bench_arena(argc >= 3 ? (unsigned int) atoi(argv[2]) : 20000,
+                    argc >= 4 ? atol(argv[3]) : 10000000);
+        exit(0);
+    }
+    fprintf(stderr, "usage: message_slot_harness check | bench [channels] [iterations] | arena [channels] [iterations]\n");
+    exit(1);
+}
@@ -0,0 +1,284 @@
+#include "message_slot_core.h"
+#undef __KERNEL__
+#define __KERNEL__
+#undef MODULE
+#define MODULE
+
+// this code is based on CHARDEV1, CHARDEV2 files from recitation 6
+// the channel/slot logic itself lives in message_slot_core.c
+
+#include <linux/kernel.h>   /* We're doing kernel work */
+#include <linux/module.h>   /* Specifically, a module */
+#include <linux/fs.h>       /* for register_chrdev */
+#include <linux/uaccess.h>  /* for get_user and put_user */
+#include <linux/string.h>   /* for memset. NOTE - not string.h!*/
+#include <linux/slab.h> /* for GFP_KERNEL flag */
+#include <linux/uio.h>      /* for copy_to_iter and copy_from_iter */
+#include <linux/splice.h>   /* for iter_file_splice_write */
+#include <linux/version.h>
+#include <linux/debugfs.h>  /* for the snapshot file */
+#include <linux/poll.h>     /* for poll_wait */
+
+MODULE_LICENSE("GPL");
+
+// NUMA node for new channels, by default a channel is
+// created on the node of the process which invoked it first.
+// it is passed to kmalloc_node, so only valid nodes are taken
+static int channel_node_set(const char* val, const struct kernel_param* kp)
+{
+    int node;
+    int rc = kstrtoint(val, 0, &node);
+    if (rc != SUCCESS){
+        return rc;
+    }
+    if (!channel_node_valid(node)){
+        return -EINVAL;
+    }
+    WRITE_ONCE(*(int*) kp->arg, node);
+    return SUCCESS;
+}
+
+static const struct kernel_param_ops channel_node_ops = {
+        .set = channel_node_set,
+        .get = param_get_int,
+};
+module_param_cb(channel_node, &channel_node_ops, &channel_node, 0644);
+MODULE_PARM_DESC(channel_node, "NUMA node for channel metadata (-1 for the invoking process's node)");
+
+//================== DEVICE FUNCTIONS ===========================
+static int device_open( struct inode* inode,
+                        struct file*  file )
+{
+    int minor = iminor(inode);
+    message_slot *new_slot = kmalloc(sizeof(message_slot), GFP_KERNEL);
+
+    printk("Invoking device_open(%p)\n", file);
+    if (new_slot == NULL){
+        printk("device_open kmalloc failed(%p)\n", file);
+        // the error of malloc and calloc on failure as mentioned here:
+        // https://man7.org/linux/man-pages/man3/malloc.3.html
+        return -ENOMEM;
+    }
+    slot_init(new_slot, minor);
+    file->private_data = (void*) new_slot;
+    return SUCCESS;
+}
+
+//---------------------------------------------------------------
+static int device_release( struct inode* inode,
+                           struct file*  file)
+{
+    message_slot *current_slot = (message_slot*) (file->private_data);
+    printk("Invoking device_release(%p,%p)\n", inode, file);
+    slot_release(current_slot);
+    kfree(current_slot);
+    return SUCCESS;
+}
+
+//---------------------------------------------------------------
+// a process which has already opened
+// the device file attempts to read from it
+static ssize_t device_read( struct file* file,
+                            char __user* buffer,
+                            size_t       length,
+                            loff_t*      offset )
+{
+    pr_debug("Invoking device_read(%p,%ld)\n", file, length);
+    return slot_read((message_slot*) file->private_data, buffer, length, offset);
+}
+
+//---------------------------------------------------------------
+// a processs which has already opened
+// the device file attempts to write to it
+static ssize_t device_write(struct file* file, const char __user* buffer, size_t length, loff_t* offset)
+{
+    pr_debug("Invoking device_write(%p,%ld)\n", file, length);
+    return slot_write((message_slot*) file->private_data, buffer, length, offset);
+}
+
+//---------------------------------------------------------------
+// iov_iter versions of device_read and device_write with the same
+// semantics, streaming mode included, the splice helpers below are
+// built on top of them so a message can be moved between a channel
+// and a pipe without passing through a user buffer
+static ssize_t device_read_iter(struct kiocb* iocb, struct iov_iter* to)
+{
+    return slot_read_iter((message_slot*) iocb->ki_filp->private_data, to, &iocb->ki_pos);
+}
+
+//---------------------------------------------------------------
+static ssize_t device_write_iter(struct kiocb* iocb, struct iov_iter* from)
+{
+    return slot_write_iter((message_slot*) iocb->ki_filp->private_data, from, &iocb->ki_pos);
+}
+
+//---------------------------------------------------------------
+// readable while the invoked channel holds a message this file hasn't
+// read (see MSG_SLOT_SET_FOLLOW), writes never block
+static __poll_t device_poll(struct file* file, poll_table* wait)
+{
+    message_slot *current_slot = (message_slot*) (file->private_data);
+    channel *temp_head = find_invoked_channel(current_slot);
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    if (temp_head == NULL){
+        return EPOLLERR;
+    }
+    poll_wait(file, &temp_head->readers, wait);
+    // poll_wait only queues us, it has no barrier of its own. order the
+    // queueing before reading the channel, this pairs with the barrier in
+    // wq_has_sleeper after channel_publish stores the message: either the
+    // writer sees us queued and wakes us, or we see its message
+    smp_mb();
+    if (slot_has_unread(current_slot)){
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    return mask;
+}
+
+//----------------------------------------------------------------
+static long device_ioctl(struct file* file, unsigned int ioctl_command_id, unsigned long ioctl_param ) {
+    pr_debug("Invoking ioctl %u(%ld)\n", ioctl_command_id, ioctl_param);
+    return slot_ioctl((message_slot *) file->private_data, &file->f_pos, ioctl_command_id, ioctl_param);
+}
+
+//==================== SNAPSHOT =================================
+// <debugfs>/message_slot/snapshot serialises all slots and channels into the
+// image described in message_slot.h when read, and imports such an image into
+// the running module when written, so a driver upgrade can be done by saving
+// the image, reloading the module and writing the image back
+
+static struct dentry *snapshot_dir;
+
+//---------------------------------------------------------------
+static int snapshot_open(struct inode* inode, struct file* file)
+{
+    slot_image *img;
+    int rc;
+    // an image is either exported or imported
+    if ((file->f_mode & FMODE_READ) && (file->f_mode & FMODE_WRITE)){
+        return -EINVAL;
+    }
+    img = kzalloc(sizeof(slot_image), GFP_KERNEL);
+    if (img == NULL){
+        return -ENOMEM;
+    }
+    if (file->f_mode & FMODE_READ){
+        rc = export_slots(img);
+        if (rc != SUCCESS){
+            kvfree(img->data);
+            kfree(img);
+            return rc;
+        }
+    }
+    file->private_data = img;
+    return SUCCESS;
+}
+
+static int snapshot_release(struct inode* inode, struct file* file)
+{
+    slot_image *img = (slot_image*) file->private_data;
+    if ((file->f_mode & FMODE_WRITE) && img->error == SUCCESS &&
+        (img->size != 0 || img->records_left != 0)){
+        printk(KERN_WARNING "%s: snapshot image truncated, %u records not imported\n",
+               DEVICE_RANGE_NAME, img->records_left);
+    }
+    kvfree(img->data);
+    kfree(img);
+    return SUCCESS;
+}
+
+static ssize_t snapshot_read(struct file* file, char __user* buffer, size_t length, loff_t* offset)
+{
+    slot_image *img = (slot_image*) file->private_data;
+    return simple_read_from_buffer(buffer, length, offset, img->data, img->size);
+}
+
+static ssize_t snapshot_write(struct file* file, const char __user* buffer, size_t length, loff_t* offset)
+{
+    slot_image *img = (slot_image*) file->private_data;
+    int rc;
+    if (img->error != SUCCESS){
+        return img->error;
+    }
+    // a short write, the caller will come back with the rest
+    length = min_t(size_t, length, MSG_SLOT_STREAM_MAX);
+    rc = image_reserve(img, length);
+    if (rc != SUCCESS){
+        return rc;
+    }
+    if (copy_from_user(img->data + img->size, buffer, length) != 0){
+        return -EFAULT;
+    }
+    img->size += length;
+    rc = import_pending(img);
+    if (rc != SUCCESS){
+        img->error = rc;
+        return rc;
+    }
+    *offset += length;
+    return length;
+}
+
+static const struct file_operations snapshot_fops = {
+        .owner          = THIS_MODULE,
+        .open           = snapshot_open,
+        .release        = snapshot_release,
+        .read           = snapshot_read,
+        .write          = snapshot_write,
+};
+
+//==================== DEVICE SETUP =============================
+struct file_operations Fops = {
+        .owner	  = THIS_MODULE,
+        .read           = device_read,
+        .write          = device_write,
+        .open           = device_open,
+        .release        = device_release,
+        .unlocked_ioctl = device_ioctl,
+        .poll           = device_poll,
+        // streaming mode keeps the position within the message in f_pos
+        .llseek         = default_llseek,
+        .read_iter      = device_read_iter,
+        .write_iter     = device_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+        .splice_read    = copy_splice_read,
+#else
+        .splice_read    = generic_file_splice_read,
+#endif
+        .splice_write   = iter_file_splice_write,
+};
+
+static int __init message_slot_init(void)
+{
+    // taken from CHARDEV2\chardev.c file from recitation 6
+    int rc = -1;
+
+    // Register driver capabilities. Obtain major num
+    rc = register_chrdev( MAJOR_NUM, DEVICE_RANGE_NAME, &Fops );
+    // Negative values signify an error
+    if( rc < 0 ) {
+        printk( KERN_ERR "%s registraion failed for  %d\n",
+                DEVICE_FILE_NAME, MAJOR_NUM );
+        return rc;
+    }
+    slots_init();
+    // the snapshot file is optional, debugfs errors are not fatal
+    snapshot_dir = debugfs_create_dir(MSG_SLOT_SNAPSHOT_DIR, NULL);
+    debugfs_create_file(MSG_SLOT_SNAPSHOT_FILE, 0600, snapshot_dir, NULL, &snapshot_fops);
+    return SUCCESS;
+}
+
+static void __exit message_slot_cleanup(void)
+{
+    debugfs_remove_recursive(snapshot_dir);
+    slots_cleanup();
+    // Unregister the device
+    // Should always succeed
+    unregister_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME);
+}
+
+//---------------------------------------------------------------
+
+module_init(message_slot_init);
+module_exit(message_slot_cleanup);
+//========================= END OF FILE =========================
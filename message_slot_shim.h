@@ -0,0 +1,245 @@
+// user-mode stand-ins for the kernel APIs message_slot_core.c uses, so the
+// core can be built into ordinary programs (see message_slot_harness.c).
+// Memory comes from malloc, "user" pointers are plain pointers, and RCU
+// callbacks run immediately: the shim is meant for a single thread driving
+// the core, which is what the harness does
+#ifndef MESSAGE_SLOT_SHIM_H
+#define MESSAGE_SLOT_SHIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#define __user
+#define __rcu
+#define printk(...) ((void) 0)
+#define KERN_WARNING ""
+
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#ifndef EBADMSG
+#define EBADMSG 74
+#endif
+
+//================== MEMORY =====================================
+typedef unsigned int gfp_t;
+#define GFP_KERNEL 0u
+#define NUMA_NO_NODE (-1)
+#define MAX_NUMNODES 1
+
+static inline void *kmalloc(size_t size, gfp_t flags) { (void) flags; return malloc(size); }
+static inline void *kmalloc_array(size_t n, size_t size, gfp_t flags) { (void) flags; return malloc(n * size); }
+static inline void *kzalloc(size_t size, gfp_t flags) { (void) flags; return calloc(1, size); }
+static inline void *kmalloc_node(size_t size, gfp_t flags, int node) { (void) node; return kmalloc(size, flags); }
+static inline void *kvmalloc(size_t size, gfp_t flags) { return kmalloc(size, flags); }
+static inline void *kvmalloc_node(size_t size, gfp_t flags, int node) { return kmalloc_node(size, flags, node); }
+static inline void kfree(const void *ptr) { free((void *) ptr); }
+static inline void kvfree(const void *ptr) { free((void *) ptr); }
+
+// pages are plain memory, a chunk of 2MB or more is aligned to its size
+// and handed to transparent huge pages, as the kernel's direct map would
+struct page;
+#define PAGE_SHIFT 12
+#define __GFP_COMP 0u
+#define __GFP_NORETRY 0u
+#define __GFP_NOWARN 0u
+#define L1_CACHE_BYTES 64
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((size_t) (a) - 1))
+static inline unsigned int get_order(size_t size)
+{
+    unsigned int order = 0;
+    while (((size_t) 1 << (order + PAGE_SHIFT)) < size) {
+        order++;
+    }
+    return order;
+}
+static inline struct page *alloc_pages_node(int node, gfp_t flags, unsigned int order)
+{
+    size_t size = (size_t) 1 << (order + PAGE_SHIFT);
+    void *ptr = aligned_alloc(size, size);
+    (void) node;
+    (void) flags;
+    if (ptr != NULL){
+        madvise(ptr, size, MADV_HUGEPAGE);
+    }
+    return (struct page *) ptr;
+}
+static inline void *page_address(struct page *page) { return page; }
+static inline void __free_pages(struct page *page, unsigned int order) { (void) order; free(page); }
+
+static inline int numa_node_id(void) { return 0; }
+static inline int cpu_to_node(int cpu) { (void) cpu; return 0; }
+static inline int node_online(int node) { return node == 0; }
+
+//================== USER COPIES ================================
+// both return the number of bytes not copied, as in the kernel, and a
+// NULL user pointer faults
+static inline unsigned long copy_to_user(void *to, const void *from, unsigned long n)
+{
+    if (to == NULL){
+        return n;
+    }
+    memcpy(to, from, n);
+    return 0;
+}
+static inline unsigned long copy_from_user(void *to, const void *from, unsigned long n)
+{
+    if (from == NULL){
+        return n;
+    }
+    memcpy(to, from, n);
+    return 0;
+}
+// a single-segment iov_iter, the copies return the number of bytes
+// copied and stop short at a NULL buffer like the faulting user copies
+#define READ 0
+#define WRITE 1
+struct iov_iter{
+    char *buf;
+    size_t count;
+};
+static inline void iov_iter_init(struct iov_iter *i, unsigned int direction,
+                                 const struct iovec *iov, unsigned long nr_segs, size_t count)
+{
+    (void) direction;
+    (void) nr_segs;
+    i->buf = iov->iov_base;
+    i->count = count;
+}
+static inline size_t iov_iter_count(const struct iov_iter *i) { return i->count; }
+static inline size_t copy_to_iter(const void *from, size_t n, struct iov_iter *i)
+{
+    if (i->buf == NULL || n > i->count){
+        return 0;
+    }
+    memcpy(i->buf, from, n);
+    i->buf += n;
+    i->count -= n;
+    return n;
+}
+static inline size_t copy_from_iter(void *to, size_t n, struct iov_iter *i)
+{
+    if (i->buf == NULL || n > i->count){
+        return 0;
+    }
+    memcpy(to, i->buf, n);
+    i->buf += n;
+    i->count -= n;
+    return n;
+}
+#define put_user(x, ptr) ((*(ptr) = (x)), 0)
+#define get_user(x, ptr) (((x) = *(ptr)), 0)
+
+//================== TIME =======================================
+// jiffies only move when the caller moves them, HZ is 1000
+extern unsigned long jiffies;
+#define time_after(a, b) ((long) ((b) - (a)) < 0)
+#define time_before(a, b) time_after(b, a)
+static inline unsigned long msecs_to_jiffies(unsigned int ms) { return ms; }
+static inline unsigned long nsecs_to_jiffies(u64 ns) { return ns / 1000000; }
+static inline u64 ktime_get_real_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//================== HELPERS ====================================
+#define container_of(ptr, type, member) ((type *) ((char *) (ptr) - offsetof(type, member)))
+#define struct_size(p, member, n) (sizeof(*(p)) + sizeof((p)->member[0]) * (n))
+#define min_t(type, a, b) ((type) (a) < (type) (b) ? (type) (a) : (type) (b))
+#define max_t(type, a, b) ((type) (a) > (type) (b) ? (type) (a) : (type) (b))
+#define READ_ONCE(x) (*(volatile __typeof__(x) *) &(x))
+#define WRITE_ONCE(x, val) (*(volatile __typeof__(x) *) &(x) = (val))
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define cmpxchg64(p, old, new) ({ \
+        __typeof__(*(p)) __old = (old); \
+        __atomic_compare_exchange_n((p), &__old, (new), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+        __old; \
+    })
+
+//================== LOCKING, KREF AND RCU ======================
+typedef struct { int locked; } spinlock_t;
+#define DEFINE_SPINLOCK(x) spinlock_t x = { 0 }
+static inline void spin_lock_init(spinlock_t *lock) { lock->locked = 0; }
+static inline void spin_lock(spinlock_t *lock)
+{
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+    }
+}
+static inline void spin_unlock(spinlock_t *lock) { __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE); }
+struct mutex{
+    spinlock_t lock;
+};
+static inline void mutex_init(struct mutex *m) { spin_lock_init(&m->lock); }
+static inline void mutex_lock(struct mutex *m) { spin_lock(&m->lock); }
+static inline void mutex_unlock(struct mutex *m) { spin_unlock(&m->lock); }
+static inline void mutex_destroy(struct mutex *m) { (void) m; }
+// there are no bottom halves in user mode
+#define spin_lock_bh(lock) spin_lock(lock)
+#define spin_unlock_bh(lock) spin_unlock(lock)
+#define lockdep_is_held(lock) 1
+
+struct kref { int refcount; };
+static inline void kref_init(struct kref *kref) { kref->refcount = 1; }
+static inline void kref_get(struct kref *kref) { __atomic_add_fetch(&kref->refcount, 1, __ATOMIC_RELAXED); }
+static inline int kref_get_unless_zero(struct kref *kref)
+{
+    int count = __atomic_load_n(&kref->refcount, __ATOMIC_RELAXED);
+    while (count != 0) {
+        if (__atomic_compare_exchange_n(&kref->refcount, &count, count + 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            return 1;
+        }
+    }
+    return 0;
+}
+static inline int kref_put(struct kref *kref, void (*release)(struct kref *kref))
+{
+    if (__atomic_sub_fetch(&kref->refcount, 1, __ATOMIC_ACQ_REL) == 0){
+        release(kref);
+        return 1;
+    }
+    return 0;
+}
+
+struct rcu_head { void *unused; };
+static inline void rcu_read_lock(void) {}
+static inline void rcu_read_unlock(void) {}
+// there are no concurrent readers to wait for
+static inline void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) { func(head); }
+static inline void rcu_barrier(void) {}
+#define rcu_dereference(p) (p)
+#define rcu_dereference_protected(p, c) (p)
+#define rcu_access_pointer(p) (p)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+static inline void synchronize_rcu(void) {}
+
+// a single CPU
+#define __percpu
+#define nr_cpu_ids 1
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; ++(cpu))
+#define alloc_percpu(type) ((type *) calloc(1, sizeof(type)))
+#define free_percpu(ptr) free(ptr)
+#define per_cpu_ptr(ptr, cpu) ((void) (cpu), (ptr))
+#define raw_cpu_ptr(ptr) (ptr)
+
+// nothing sleeps in user mode, poll() is not part of the shim. there
+// always is a sleeper and wake ups are counted, for the checks
+typedef struct { int wakeups; } wait_queue_head_t;
+static inline void init_waitqueue_head(wait_queue_head_t *wq) { wq->wakeups = 0; }
+static inline int wq_has_sleeper(wait_queue_head_t *wq) { (void) wq; return 1; }
+static inline void wake_up_interruptible(wait_queue_head_t *wq) { wq->wakeups++; }
+
+#endif
@@ -0,0 +1,524 @@
+// user-space message slot on a POSIX shared memory segment
+//
+// A segment is a fixed size open addressing table of channels. Writers
+// serialise on a per channel sequence counter (odd while a write is in
+// progress) and readers use it as a seqlock, so a read never blocks and
+// never writes to shared memory. Every write also bumps the segment's
+// generation, which is the futex word waiters sleep on.
+//
+// A writer which dies between making seq odd and making it even again
+// leaves the channel locked for good: nothing can tell a dead writer from
+// a slow one. Readers and writers wait for an odd seq at most
+// MSG_SLOT_SHM_STUCK_MS and then fail with ETIMEDOUT, the other channels
+// keep working and the segment has to be recreated to free the channel.
+#include "message_slot_shm.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <fcntl.h>      /* open */
+#include <unistd.h>     /* close */
+#include <sys/ioctl.h>  /* ioctl */
+#include <sys/mman.h>   /* shm_open, mmap */
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sched.h>      /* sched_yield */
+#include <pthread.h>
+#include <poll.h>
+#include <linux/futex.h>
+
+typedef struct shm_channel{
+    // 0 while the entry is free
+    atomic_uint channel_id;
+    // even when stable, odd while a writer is copying the message
+    atomic_uint seq;
+    unsigned int message_size;
+    char current_message[BUF_LEN];
+} shm_channel;
+
+typedef struct shm_segment{
+    atomic_uint generation;
+    // processes sleeping on generation, writers skip the wake up without them
+    atomic_uint waiters;
+    shm_channel channels[MSG_SLOT_SHM_CHANNELS];
+} shm_segment;
+
+// a process maps each segment once, however many clients it opens on it,
+// so a slot's clients share one mapping and can be told apart from other
+// segments' by its address
+typedef struct shm_mapping{
+    dev_t dev;
+    ino_t ino;
+    shm_segment* segment;
+    int clients;
+    struct shm_mapping* next;
+} shm_mapping;
+
+static shm_mapping* mappings;
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct msg_slot_client{
+    // -1 for the shared memory backend
+    int fd;
+    shm_segment* segment;
+    shm_channel* invoked_channel;
+    // MSG_SLOT_SET_FOLLOW and the seq of the last message read
+    int follow_mode;
+    unsigned int last_read_seq;
+};
+
+static long futex(atomic_uint* word, int op, unsigned int val, const struct timespec* timeout) {
+    // the segment is shared between processes, no FUTEX_PRIVATE_FLAG
+    return syscall(SYS_futex, word, op, val, timeout, NULL, 0);
+}
+
+// spins this many times on an odd seq before yielding the cpu
+#define SHM_SPINS 128
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// waits until no write to ch is in progress and returns its even seq,
+// -1 with ETIMEDOUT if the writer doesn't finish in MSG_SLOT_SHM_STUCK_MS
+static long long shm_wait_stable(shm_channel* ch, memory_order order) {
+    unsigned int seq = atomic_load_explicit(&ch->seq, order);
+    long long deadline = 0;
+    unsigned int spins = 0;
+    while (seq & 1) {
+        if (++spins < SHM_SPINS){
+            cpu_relax();
+        } else {
+            // the writer may have been preempted, let it run
+            if (deadline == 0){
+                deadline = now_ms() + MSG_SLOT_SHM_STUCK_MS;
+            } else if (now_ms() >= deadline){
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            sched_yield();
+        }
+        seq = atomic_load_explicit(&ch->seq, order);
+    }
+    return seq;
+}
+
+// finds the channel in the table, claiming a free entry for a new one
+static shm_channel* find_or_add_channel(shm_segment* segment, unsigned int channel_id) {
+    unsigned int i = (channel_id * 2654435761u) % MSG_SLOT_SHM_CHANNELS;
+    unsigned int probes;
+    unsigned int id;
+    for (probes = 0; probes < MSG_SLOT_SHM_CHANNELS; ++probes) {
+        shm_channel* ch = &segment->channels[i];
+        id = atomic_load_explicit(&ch->channel_id, memory_order_acquire);
+        if (id == channel_id){
+            return ch;
+        }
+        if (id == 0){
+            if (atomic_compare_exchange_strong(&ch->channel_id, &id, channel_id) || id == channel_id){
+                return ch;
+            }
+        }
+        i = (i + 1) % MSG_SLOT_SHM_CHANNELS;
+    }
+    return NULL;
+}
+
+//================== SHARED MEMORY BACKEND ======================
+// maps a segment this process hasn't mapped yet, called with mappings_lock held
+static shm_mapping* shm_map_segment(int shm_fd, const struct stat* shm_stat) {
+    shm_mapping* mapping = malloc(sizeof(shm_mapping));
+    void* segment;
+    if (mapping == NULL){
+        return NULL;
+    }
+    // a new segment is zero filled, which is an empty slot
+    if (ftruncate(shm_fd, sizeof(shm_segment)) < 0){
+        free(mapping);
+        return NULL;
+    }
+    segment = mmap(NULL, sizeof(shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (segment == MAP_FAILED){
+        free(mapping);
+        return NULL;
+    }
+    mapping->dev = shm_stat->st_dev;
+    mapping->ino = shm_stat->st_ino;
+    mapping->segment = (shm_segment*) segment;
+    mapping->clients = 0;
+    mapping->next = mappings;
+    mappings = mapping;
+    return mapping;
+}
+
+// the segment is found by its inode rather than its name, a segment
+// unlinked and created again under the same name is a new one
+static msg_slot_client* shm_open_slot(msg_slot_client* client, const char* name, mode_t mode) {
+    int shm_fd = shm_open(name, O_RDWR | O_CREAT, mode);
+    struct stat shm_stat;
+    shm_mapping* mapping;
+    if (shm_fd < 0){
+        return NULL;
+    }
+    if (fstat(shm_fd, &shm_stat) < 0){
+        close(shm_fd);
+        return NULL;
+    }
+    pthread_mutex_lock(&mappings_lock);
+    for (mapping = mappings; mapping != NULL; mapping = mapping->next) {
+        if (mapping->dev == shm_stat.st_dev && mapping->ino == shm_stat.st_ino){
+            break;
+        }
+    }
+    if (mapping == NULL){
+        mapping = shm_map_segment(shm_fd, &shm_stat);
+    }
+    if (mapping != NULL){
+        mapping->clients++;
+        client->segment = mapping->segment;
+    }
+    pthread_mutex_unlock(&mappings_lock);
+    close(shm_fd);
+    return mapping != NULL ? client : NULL;
+}
+
+static void shm_close_slot(shm_segment* segment) {
+    shm_mapping** link;
+    shm_mapping* mapping;
+    pthread_mutex_lock(&mappings_lock);
+    for (link = &mappings; *link != NULL; link = &(*link)->next) {
+        mapping = *link;
+        if (mapping->segment == segment){
+            if (--mapping->clients == 0){
+                *link = mapping->next;
+                munmap(segment, sizeof(shm_segment));
+                free(mapping);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mappings_lock);
+}
+
+// in follow mode a message whose seq is *read_seq was read already,
+// *read_seq is updated by a successful read
+static ssize_t shm_read(shm_channel* ch, void* buffer, size_t length, unsigned int* read_seq, int follow) {
+    long long stable;
+    unsigned int before, after;
+    unsigned int message_size;
+    for (;;) {
+        stable = shm_wait_stable(ch, memory_order_acquire);
+        if (stable < 0){
+            return -1;
+        }
+        before = stable;
+        message_size = ch->message_size;
+        if (message_size == 0 || (follow && before == *read_seq)){
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+        if (length < message_size){
+            errno = ENOSPC;
+            return -1;
+        }
+        memcpy(buffer, ch->current_message, message_size);
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&ch->seq, memory_order_relaxed);
+        if (before == after){
+            *read_seq = before;
+            return message_size;
+        }
+    }
+}
+
+static ssize_t shm_write(shm_segment* segment, shm_channel* ch, const void* buffer, size_t length) {
+    long long stable;
+    unsigned int seq;
+    if (length == 0 || length > BUF_LEN){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    do {
+        stable = shm_wait_stable(ch, memory_order_relaxed);
+        if (stable < 0){
+            return -1;
+        }
+        seq = stable;
+    } while (!atomic_compare_exchange_weak_explicit(&ch->seq, &seq, seq + 1,
+                                                    memory_order_acquire, memory_order_relaxed));
+    atomic_thread_fence(memory_order_release);
+    memcpy(ch->current_message, buffer, length);
+    ch->message_size = length;
+    atomic_store_explicit(&ch->seq, seq + 2, memory_order_release);
+
+    atomic_fetch_add(&segment->generation, 1);
+    if (atomic_load(&segment->waiters) != 0){
+        futex(&segment->generation, FUTEX_WAKE, INT_MAX, NULL);
+    }
+    return length;
+}
+
+//================== CLIENT API =================================
+msg_slot_client* msg_slot_open(const char* path) {
+    return msg_slot_open_mode(path, MSG_SLOT_SHM_MODE);
+}
+
+msg_slot_client* msg_slot_open_mode(const char* path, mode_t mode) {
+    msg_slot_client* client = calloc(1, sizeof(msg_slot_client));
+    if (client == NULL){
+        return NULL;
+    }
+    client->fd = -1;
+    if (strncmp(path, MSG_SLOT_SHM_PREFIX, strlen(MSG_SLOT_SHM_PREFIX)) == 0){
+        if (shm_open_slot(client, path + strlen(MSG_SLOT_SHM_PREFIX), mode) == NULL){
+            free(client);
+            return NULL;
+        }
+        return client;
+    }
+    client->fd = open(path, O_RDWR);
+    if (client->fd < 0){
+        free(client);
+        return NULL;
+    }
+    return client;
+}
+
+int msg_slot_set_channel(msg_slot_client* client, unsigned int channel_id) {
+    if (client->fd >= 0){
+        return ioctl(client->fd, MSG_SLOT_CHANNEL, channel_id);
+    }
+    if (channel_id == 0){
+        errno = EINVAL;
+        return -1;
+    }
+    client->invoked_channel = find_or_add_channel(client->segment, channel_id);
+    client->last_read_seq = 0;
+    if (client->invoked_channel == NULL){
+        errno = ENOMEM;
+        return -1;
+    }
+    return SUCCESS;
+}
+
+ssize_t msg_slot_read(msg_slot_client* client, void* buffer, size_t length) {
+    if (client->fd >= 0){
+        return read(client->fd, buffer, length);
+    }
+    if (client->invoked_channel == NULL || buffer == NULL){
+        errno = EINVAL;
+        return -1;
+    }
+    return shm_read(client->invoked_channel, buffer, length, &client->last_read_seq, client->follow_mode);
+}
+
+ssize_t msg_slot_write(msg_slot_client* client, const void* buffer, size_t length) {
+    if (client->fd >= 0){
+        return write(client->fd, buffer, length);
+    }
+    if (client->invoked_channel == NULL || buffer == NULL){
+        errno = EINVAL;
+        return -1;
+    }
+    return shm_write(client->segment, client->invoked_channel, buffer, length);
+}
+
+ssize_t msg_slot_write_batch(msg_slot_client* client, struct msg_slot_batch_entry* entries, unsigned int count) {
+    struct msg_slot_batch batch;
+    shm_channel* ch;
+    unsigned int written;
+    if (client->fd >= 0){
+        batch.count = count;
+        batch.reserved = 0;
+        batch.entries = (unsigned long) entries;
+        return ioctl(client->fd, MSG_SLOT_WRITE_BATCH, &batch);
+    }
+    if (count == 0 || count > MSG_SLOT_BATCH_MAX){
+        errno = EINVAL;
+        return -1;
+    }
+    for (written = 0; written < count; ++written) {
+        if (entries[written].channel_id == 0){
+            errno = EINVAL;
+            break;
+        }
+        ch = find_or_add_channel(client->segment, entries[written].channel_id);
+        if (ch == NULL){
+            errno = ENOMEM;
+            break;
+        }
+        if (shm_write(client->segment, ch, (const void*) (unsigned long) entries[written].buffer,
+                      entries[written].length) < 0){
+            break;
+        }
+    }
+    return written != 0 ? (ssize_t) written : -1;
+}
+
+int msg_slot_close(msg_slot_client* client) {
+    int rc = SUCCESS;
+    if (client->fd >= 0){
+        rc = close(client->fd);
+    } else {
+        shm_close_slot(client->segment);
+    }
+    free(client);
+    return rc;
+}
+
+unsigned int msg_slot_shm_generation(msg_slot_client* client) {
+    return atomic_load(&client->segment->generation);
+}
+
+int msg_slot_shm_wait(msg_slot_client* client, unsigned int generation, int timeout_ms) {
+    shm_segment* segment = client->segment;
+    struct timespec timeout;
+    int rc = SUCCESS;
+    if (client->fd >= 0){
+        errno = EINVAL;
+        return -1;
+    }
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    atomic_fetch_add(&segment->waiters, 1);
+    while (atomic_load(&segment->generation) == generation) {
+        if (futex(&segment->generation, FUTEX_WAIT, generation,
+                  timeout_ms < 0 ? NULL : &timeout) < 0 && errno == ETIMEDOUT){
+            rc = -1;
+            break;
+        }
+    }
+    atomic_fetch_sub(&segment->waiters, 1);
+    return rc;
+}
+
+int msg_slot_set_follow(msg_slot_client* client, int enable) {
+    if (client->fd >= 0){
+        return ioctl(client->fd, MSG_SLOT_SET_FOLLOW, enable);
+    }
+    client->follow_mode = (enable != 0);
+    client->last_read_seq = 0;
+    return SUCCESS;
+}
+
+// seq 0 is an empty channel, so a message is never mistaken for one already read
+static int shm_has_unread(msg_slot_client* client) {
+    shm_channel* ch = client->invoked_channel;
+    unsigned int seq;
+    if (ch == NULL){
+        return 0;
+    }
+    seq = atomic_load_explicit(&ch->seq, memory_order_acquire);
+    return seq != 0 && (seq & ~1u) != client->last_read_seq;
+}
+
+struct msg_slot_poller{
+    msg_slot_client** clients;
+    int count;
+    // one entry per client, poll() skips the negative descriptors of the
+    // shm clients
+    struct pollfd* fds;
+    int num_fds;
+    // the segment of the shm clients (clients of one segment share its
+    // mapping), single_segment is 0 if they use several
+    shm_segment* segment;
+    int single_segment;
+};
+
+msg_slot_poller* msg_slot_poller_create(msg_slot_client** clients, int count) {
+    msg_slot_poller* poller = malloc(sizeof(msg_slot_poller));
+    int i;
+    if (poller == NULL){
+        return NULL;
+    }
+    poller->fds = calloc(count, sizeof(struct pollfd));
+    if (poller->fds == NULL){
+        free(poller);
+        return NULL;
+    }
+    poller->clients = clients;
+    poller->count = count;
+    poller->num_fds = 0;
+    poller->segment = NULL;
+    poller->single_segment = 1;
+    for (i = 0; i < count; ++i) {
+        poller->fds[i].fd = clients[i]->fd;
+        poller->fds[i].events = POLLIN;
+        if (clients[i]->fd >= 0){
+            poller->num_fds++;
+        } else if (poller->segment == NULL){
+            poller->segment = clients[i]->segment;
+        } else if (poller->segment != clients[i]->segment){
+            poller->single_segment = 0;
+        }
+    }
+    return poller;
+}
+
+void msg_slot_poller_destroy(msg_slot_poller* poller) {
+    if (poller != NULL){
+        free(poller->fds);
+        free(poller);
+    }
+}
+
+int msg_slot_poll(msg_slot_poller* poller, int* ready, int timeout_ms) {
+    msg_slot_client** clients = poller->clients;
+    struct pollfd* fds = poller->fds;
+    int count = poller->count;
+    unsigned int generation = 0;
+    long long deadline = now_ms() + timeout_ms;
+    int found, wait_ms, rc, i;
+    for (;;) {
+        // take the generation before checking, a write after the check moves it
+        if (poller->segment != NULL){
+            generation = atomic_load(&poller->segment->generation);
+        }
+        found = 0;
+        for (i = 0; i < count; ++i) {
+            ready[i] = clients[i]->fd < 0 && shm_has_unread(clients[i]);
+            found += ready[i];
+        }
+        wait_ms = -1;
+        if (timeout_ms >= 0){
+            wait_ms = deadline > now_ms() ? (int) (deadline - now_ms()) : 0;
+        }
+        if (found != 0){
+            wait_ms = 0;
+        } else if (poller->segment != NULL && (poller->num_fds != 0 || !poller->single_segment) &&
+                   (wait_ms < 0 || wait_ms > MSG_SLOT_POLL_INTERVAL_MS)){
+            wait_ms = MSG_SLOT_POLL_INTERVAL_MS;
+        }
+        if (poller->num_fds != 0){
+            rc = poll(fds, count, wait_ms);
+            if (rc < 0 && errno != EINTR){
+                return -1;
+            }
+            for (i = 0; rc > 0 && i < count; ++i) {
+                // errors are reported as ready, so the read reports them
+                if (fds[i].revents != 0){
+                    ready[i] = 1;
+                    found++;
+                }
+            }
+        } else if (found == 0 && wait_ms != 0){
+            msg_slot_shm_wait(clients[0], generation, wait_ms);
+        }
+        if (found != 0 || (timeout_ms >= 0 && now_ms() >= deadline)){
+            return found;
+        }
+    }
+}
@@ -0,0 +1,65 @@
+// user-space implementation of the message slot API on a shared memory
+// segment, and a client API which works on top of either backend
+#ifndef MESSAGE_SLOT_SHM_H
+#define MESSAGE_SLOT_SHM_H
+
+#include "message_slot.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+// paths starting with this prefix name a shared memory segment
+// ("shm:/my_slot"), any other path is a message_slot device file
+#define MSG_SLOT_SHM_PREFIX "shm:"
+// the number of channels a shared memory slot can hold
+#define MSG_SLOT_SHM_CHANNELS 4096
+// the permissions of a new segment, only its creator's processes may use it
+#define MSG_SLOT_SHM_MODE 0600
+// how long an operation waits for a write in progress on its channel
+// before failing with ETIMEDOUT, see message_slot_shm.c for why it may
+// never finish
+#define MSG_SLOT_SHM_STUCK_MS 1000
+
+typedef struct msg_slot_client msg_slot_client;
+
+// All functions mirror the system calls used on the device file: they
+// return -1 and set errno to the error code the driver would return
+
+// open a message slot, a shared memory segment is created with
+// MSG_SLOT_SHM_MODE if it doesn't exist
+msg_slot_client* msg_slot_open(const char* path);
+// same, creating a missing segment with mode (less the umask), e.g. 0660
+// to share it with a group
+msg_slot_client* msg_slot_open_mode(const char* path, mode_t mode);
+// same as ioctl(fd, MSG_SLOT_CHANNEL, channel_id)
+int msg_slot_set_channel(msg_slot_client* client, unsigned int channel_id);
+ssize_t msg_slot_read(msg_slot_client* client, void* buffer, size_t length);
+ssize_t msg_slot_write(msg_slot_client* client, const void* buffer, size_t length);
+// same as ioctl(fd, MSG_SLOT_WRITE_BATCH, ...): writes the messages in
+// order, each to its entry's channel, and returns how many were written
+ssize_t msg_slot_write_batch(msg_slot_client* client, struct msg_slot_batch_entry* entries, unsigned int count);
+int msg_slot_close(msg_slot_client* client);
+// same as ioctl(fd, MSG_SLOT_SET_FOLLOW, enable)
+int msg_slot_set_follow(msg_slot_client* client, int enable);
+
+// a poller waits on a fixed set of clients, it is created once for them
+// and then polled on every wake up. clients must outlive the poller
+typedef struct msg_slot_poller msg_slot_poller;
+msg_slot_poller* msg_slot_poller_create(msg_slot_client** clients, int count);
+void msg_slot_poller_destroy(msg_slot_poller* poller);
+// waits until at least one of the clients has a message it hasn't read or
+// timeout_ms passes (-1 waits forever). ready[i] is set for each client
+// with an unread message, and their number is returned (0 on timeout).
+// Device files are waited for with poll(), a shared memory segment with
+// its generation futex. Clients on several segments, or on both backends,
+// are rechecked every MSG_SLOT_POLL_INTERVAL_MS since a single wait can't
+// cover them all
+#define MSG_SLOT_POLL_INTERVAL_MS 10
+int msg_slot_poll(msg_slot_poller* poller, int* ready, int timeout_ms);
+
+// shared memory only: the generation counts the writes to all channels of
+// the slot, msg_slot_shm_wait blocks until it moves past generation or
+// timeout_ms passes (-1 waits forever, fails with ETIMEDOUT on timeout)
+unsigned int msg_slot_shm_generation(msg_slot_client* client);
+int msg_slot_shm_wait(msg_slot_client* client, unsigned int generation, int timeout_ms);
+
+#endif
@@ -0,0 +1,154 @@
+// measures device_read latency for every (reader node, message node) pair
+// usage: numa_bench <message_slot_file_path> <channel_id> [iterations]
+#define _GNU_SOURCE
+#include "message_slot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>      /* open */
+#include <unistd.h>     /* exit */
+#include <sched.h>      /* sched_setaffinity */
+#include <sys/ioctl.h>  /* ioctl */
+
+#define MAX_NODES 64
+
+/* returns the first cpu listed in /sys/devices/system/node/node<node>/cpulist,
+ * or -1 if the node does not exist or has no cpus */
+static int first_cpu_of_node(int node) {
+    char path[64];
+    FILE* cpulist;
+    int cpu;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    cpulist = fopen(path, "r");
+    if (cpulist == NULL){
+        return -1;
+    }
+    if (fscanf(cpulist, "%d", &cpu) != 1){
+        cpu = -1;
+    }
+    fclose(cpulist);
+    return cpu;
+}
+
+/* fills node_id and node_cpu with the online nodes which have cpus, read
+ * from /sys/devices/system/node/online ("0-1,3"), node ids need not be
+ * contiguous. returns the number of nodes found */
+static int online_nodes(int* node_id, int* node_cpu) {
+    FILE* online = fopen("/sys/devices/system/node/online", "r");
+    int num_nodes = 0;
+    int first, last, node, cpu;
+    char separator;
+    if (online == NULL){
+        return 0;
+    }
+    while (fscanf(online, "%d", &first) == 1) {
+        last = first;
+        separator = fgetc(online);
+        if (separator == '-'){
+            if (fscanf(online, "%d", &last) != 1){
+                break;
+            }
+            separator = fgetc(online);
+        }
+        for (node = first; node <= last && num_nodes < MAX_NODES; ++node) {
+            /* memory-only nodes can't run the reader */
+            cpu = first_cpu_of_node(node);
+            if (cpu >= 0){
+                node_id[num_nodes] = node;
+                node_cpu[num_nodes] = cpu;
+                num_nodes++;
+            }
+        }
+        if (separator != ','){
+            break;
+        }
+    }
+    fclose(online);
+    return num_nodes;
+}
+
+static void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0){
+        perror("sched_setaffinity() failed");
+        exit(1);
+    }
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char** argv) {
+    char the_message[BUF_LEN];
+    char* message_slot_file_path;
+    unsigned int target_message_channel_id;
+    long iterations = 1000000;
+    int node_id[MAX_NODES];
+    int node_cpu[MAX_NODES];
+    int num_nodes;
+    int reader_node, message_node;
+    long i;
+    int ifp; /* file descriptor of message_slot */
+    double start, elapsed;
+    /* checking if the input is valid */
+    if (argc == 3 || argc == 4){ /* we include the program's name */
+        message_slot_file_path = argv[1];
+        target_message_channel_id = atoi(argv[2]);
+        if (argc == 4){
+            iterations = atol(argv[3]);
+        }
+    } else{
+        perror("Invalid Input!");
+        exit(1);
+    }
+    num_nodes = online_nodes(node_id, node_cpu);
+    if (num_nodes == 0){
+        fprintf(stderr, "no NUMA nodes found in sysfs\n");
+        exit(1);
+    }
+    ifp = open(message_slot_file_path, O_RDWR);
+    if (ifp < 0){
+        perror("open() failed");
+        exit(1);
+    }
+    if (ioctl(ifp, MSG_SLOT_CHANNEL, target_message_channel_id) < 0){
+        perror("ioctl() failed");
+        exit(1);
+    }
+    memset(the_message, 'x', BUF_LEN);
+    printf("reader_node\tmessage_node\tns_per_read\n");
+    for (message_node = 0; message_node < num_nodes; ++message_node) {
+        /* the message is allocated on message_node no matter where we write from */
+        if (ioctl(ifp, MSG_SLOT_SET_NODE, node_id[message_node]) < 0){
+            perror("ioctl(MSG_SLOT_SET_NODE) failed");
+            exit(1);
+        }
+        if (write(ifp, the_message, BUF_LEN) != BUF_LEN){
+            perror("write() failed");
+            exit(1);
+        }
+        for (reader_node = 0; reader_node < num_nodes; ++reader_node) {
+            pin_to_cpu(node_cpu[reader_node]);
+            start = now_ns();
+            for (i = 0; i < iterations; ++i) {
+                if (read(ifp, the_message, BUF_LEN) != BUF_LEN){
+                    perror("read() failed");
+                    exit(1);
+                }
+            }
+            elapsed = now_ns() - start;
+            printf("%d\t%d\t%.1f\n", node_id[reader_node], node_id[message_node], elapsed / iterations);
+        }
+    }
+    /* back to following the writer */
+    ioctl(ifp, MSG_SLOT_SET_NODE, -1);
+    close(ifp);
+    exit(0);
+}
@@ -0,0 +1,190 @@
+// measures read throughput of one channel with 1, 2, 4, ... cpus reading it,
+// without and with MSG_SLOT_FLAG_PERCPU, and the write cost of each mode
+// usage: percpu_bench <message_slot_file_path> <channel_id> [seconds]
+#define _GNU_SOURCE
+#include "message_slot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <fcntl.h>      /* open */
+#include <unistd.h>     /* exit, sleep */
+#include <sched.h>      /* sched_setaffinity */
+#include <sys/ioctl.h>  /* ioctl */
+
+#define WRITE_ITERATIONS 10000
+
+typedef struct reader_thread{
+    pthread_t thread;
+    int cpu;
+    unsigned long long reads;
+} reader_thread;
+
+static const char* message_slot_file_path;
+static unsigned int target_message_channel_id;
+static atomic_int stop;
+static atomic_int started;
+// the cpus this process may run on, their ids need not be contiguous
+static int* cpus;
+
+static void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0){
+        perror("sched_setaffinity() failed");
+        exit(1);
+    }
+}
+
+// fills cpus from the affinity mask, which a cpuset or taskset may restrict,
+// and returns their number
+static int allowed_cpus(void) {
+    cpu_set_t set;
+    int cpu, num_cpus = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) < 0){
+        perror("sched_getaffinity() failed");
+        exit(1);
+    }
+    cpus = malloc(CPU_COUNT(&set) * sizeof(int));
+    if (cpus == NULL){
+        perror("malloc() failed");
+        exit(1);
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)){
+            cpus[num_cpus++] = cpu;
+        }
+    }
+    return num_cpus;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int open_channel(void) {
+    int ifp = open(message_slot_file_path, O_RDWR);
+    if (ifp < 0){
+        perror("open() failed");
+        exit(1);
+    }
+    if (ioctl(ifp, MSG_SLOT_CHANNEL, target_message_channel_id) < 0){
+        perror("ioctl() failed");
+        exit(1);
+    }
+    return ifp;
+}
+
+static void* reader_worker(void* arg) {
+    reader_thread* self = (reader_thread*) arg;
+    char the_message[BUF_LEN];
+    // counted locally, the reader_threads share cache lines
+    unsigned long long reads = 0;
+    int ifp;
+    pin_to_cpu(self->cpu);
+    ifp = open_channel();
+    atomic_fetch_add(&started, 1);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        if (read(ifp, the_message, BUF_LEN) != BUF_LEN){
+            perror("read() failed");
+            exit(1);
+        }
+        reads++;
+    }
+    self->reads = reads;
+    close(ifp);
+    return NULL;
+}
+
+static double run_readers(reader_thread* threads, int num_threads, int seconds) {
+    unsigned long long reads = 0;
+    double start;
+    int i;
+    atomic_store(&stop, 0);
+    atomic_store(&started, 0);
+    for (i = 0; i < num_threads; ++i) {
+        threads[i].cpu = cpus[i];
+        threads[i].reads = 0;
+        if (pthread_create(&threads[i].thread, NULL, reader_worker, &threads[i]) != 0){
+            perror("pthread_create() failed");
+            exit(1);
+        }
+    }
+    while (atomic_load(&started) != num_threads) {
+    }
+    start = now_ns();
+    sleep(seconds);
+    atomic_store(&stop, 1);
+    for (i = 0; i < num_threads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        reads += threads[i].reads;
+    }
+    return reads / ((now_ns() - start) / 1e9);
+}
+
+int main(int argc, char** argv) {
+    char the_message[BUF_LEN];
+    static const unsigned int modes[] = {0, MSG_SLOT_FLAG_PERCPU};
+    reader_thread* threads;
+    int num_cpus;
+    int seconds = 1;
+    int ifp; /* file descriptor of message_slot, used for writes */
+    int num_threads, mode;
+    double start, reads_per_second;
+    long i;
+    /* checking if the input is valid */
+    if (argc == 3 || argc == 4){ /* we include the program's name */
+        message_slot_file_path = argv[1];
+        target_message_channel_id = atoi(argv[2]);
+        if (argc == 4){
+            seconds = atoi(argv[3]);
+        }
+    } else{
+        perror("Invalid Input!");
+        exit(1);
+    }
+    num_cpus = allowed_cpus();
+    threads = calloc(num_cpus, sizeof(reader_thread));
+    if (threads == NULL){
+        perror("calloc() failed");
+        exit(1);
+    }
+    ifp = open_channel();
+    memset(the_message, 'x', BUF_LEN);
+    printf("percpu\tcpus\treads_per_sec\treads_per_sec_per_cpu\n");
+    for (mode = 0; mode < 2; ++mode) {
+        if (ioctl(ifp, MSG_SLOT_SET_FLAGS, modes[mode]) < 0){
+            perror("ioctl(MSG_SLOT_SET_FLAGS) failed");
+            exit(1);
+        }
+        start = now_ns();
+        for (i = 0; i < WRITE_ITERATIONS; ++i) {
+            if (write(ifp, the_message, BUF_LEN) != BUF_LEN){
+                perror("write() failed");
+                exit(1);
+            }
+        }
+        fprintf(stderr, "percpu %d: %.1f ns per write\n", mode, (now_ns() - start) / WRITE_ITERATIONS);
+        for (num_threads = 1; ; num_threads *= 2) {
+            if (num_threads > num_cpus){
+                num_threads = num_cpus;
+            }
+            reads_per_second = run_readers(threads, num_threads, seconds);
+            printf("%d\t%d\t%.0f\t%.0f\n", mode, num_threads, reads_per_second, reads_per_second / num_threads);
+            if (num_threads == num_cpus){
+                break;
+            }
+        }
+    }
+    ioctl(ifp, MSG_SLOT_SET_FLAGS, 0);
+    close(ifp);
+    free(threads);
+    free(cpus);
+    exit(0);
+}